@@ -0,0 +1,395 @@
+#include "constant-resolver.hh"
+
+// Chains of definitions longer than this are given up on, which also
+// protects against cycles that the cache does not catch.
+static const unsigned int maxDepth = 64;
+
+// Walks the file like ExprDepthFirstSearch, entering a new scope at each
+// let, rec attribute set and function.
+class ConstantResolver::Search : public ExprDepthFirstSearch
+{
+    ConstantResolver & resolver;
+
+public:
+    Search(ConstantResolver & resolver, ExprVisitorBase * visitor)
+        : ExprDepthFirstSearch(visitor), resolver(resolver)
+    {
+    }
+
+    using ExprDepthFirstSearch::visit;
+
+    virtual void visit(nix::ExprVar * e)
+    {
+        resolver.recordUse(e);
+        ExprDepthFirstSearch::visit(e);
+    }
+
+    virtual void visit(nix::ExprSelect * e)
+    {
+        resolver.recordUse(e);
+        ExprDepthFirstSearch::visit(e);
+    }
+
+    virtual void visit(nix::ExprLet * e)
+    {
+        resolver.recordBindings(e->attrs);
+        const Scope * saved = resolver.current;
+        resolver.current = resolver.newScope(saved, e->attrs, nullptr);
+        ExprDepthFirstSearch::visit(e);
+        resolver.current = saved;
+    }
+
+    virtual void visit(nix::ExprAttrs * e)
+    {
+        if (!e->recursive) { return ExprDepthFirstSearch::visit(e); }
+        resolver.recordBindings(e);
+        const Scope * saved = resolver.current;
+        resolver.current = resolver.recScope(saved, e);
+        ExprDepthFirstSearch::visit(e);
+        resolver.current = saved;
+    }
+
+    virtual void visit(nix::ExprLambda * e)
+    {
+        const Scope * saved = resolver.current;
+        resolver.current = resolver.newScope(saved, nullptr, e);
+        ExprDepthFirstSearch::visit(e);
+        resolver.current = saved;
+    }
+};
+
+ConstantResolver::ConstantResolver(nix::SymbolTable & symbols)
+    : symbols(symbols), current(nullptr)
+{
+}
+
+void ConstantResolver::search(nix::Expr * e, ExprVisitorBase * visitor)
+{
+    current = nullptr;
+    Search(*this, visitor).visit(e);
+}
+
+ConstantResolver::Resolution ConstantResolver::unknown()
+{
+    Resolution r;
+    r.status = Unknown;
+    r.expr = nullptr;
+    r.scope = nullptr;
+    r.pos = nullptr;
+    r.entry = nullptr;
+    return r;
+}
+
+// An expression as seen from the expression currently being visited.
+ConstantResolver::Resolution ConstantResolver::here(const nix::Expr * e) const
+{
+    Resolution r;
+    r.status = Found;
+    r.expr = e;
+    r.scope = current;
+    r.pos = nullptr;
+    r.entry = nullptr;
+    return r;
+}
+
+// Checks whether a variable is bound in the file, rather than being a
+// builtin or coming from a "with".
+bool ConstantResolver::isBound(const Scope * scope, const nix::Symbol & name)
+{
+    for (; scope != nullptr; scope = scope->parent)
+    {
+        if (scope->lambda != nullptr)
+        {
+            if (scope->lambda->arg == name) { return true; }
+            if (scope->lambda->matchAttrs && scope->lambda->formals != nullptr)
+            {
+                for (const nix::Formal & formal : scope->lambda->formals->formals)
+                {
+                    if (formal.name == name) { return true; }
+                }
+            }
+        }
+        else if (scope->attrs->attrs.count(name))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+const ConstantResolver::Scope * ConstantResolver::newScope(const Scope * parent,
+    const nix::ExprAttrs * attrs, const nix::ExprLambda * lambda)
+{
+    Scope scope;
+    scope.parent = parent;
+    scope.attrs = attrs;
+    scope.lambda = lambda;
+    scopes.push_back(scope);
+    return &scopes.back();
+}
+
+// Returns the scope for a rec attribute set, reusing it if the set has
+// been entered from the same place before so that the cache stays useful.
+const ConstantResolver::Scope * ConstantResolver::recScope(const Scope * parent,
+    const nix::ExprAttrs * attrs)
+{
+    auto key = std::make_pair(parent, attrs);
+    auto it = recScopes.find(key);
+    if (it != recScopes.end()) { return it->second; }
+    const Scope * scope = newScope(parent, attrs, nullptr);
+    recScopes[key] = scope;
+    return scope;
+}
+
+// Follows variables and attribute selections to the expression that they
+// stand for.
+ConstantResolver::Resolution ConstantResolver::resolve(const Resolution & r,
+    unsigned int depth)
+{
+    if (r.status != Found) { return r; }
+    if (depth > maxDepth) { return unknown(); }
+
+    auto * var = dynamic_cast<const nix::ExprVar *>(r.expr);
+    if (var != nullptr)
+    {
+        Resolution value = lookupVar(r.scope, var->name, depth + 1);
+        if (value.status == Found) { return value; }
+
+        // A variable that is not bound lexically is a builtin, or comes
+        // from a "with" if there is no such builtin.  Only true and false
+        // are worth knowing about; "with" cannot hide them.
+        const std::string & name = var->name;
+        if ((name == "true" || name == "false") && !isBound(r.scope, var->name))
+        {
+            return r;
+        }
+        return unknown();
+    }
+
+    auto * select = dynamic_cast<const nix::ExprSelect *>(r.expr);
+    if (select != nullptr)
+    {
+        Resolution set = r;
+        set.expr = select->e;
+        set.pos = nullptr;
+        set = resolve(set, depth + 1);
+        for (const nix::AttrName & attrName : select->attrPath)
+        {
+            // Dynamic attribute names cannot be resolved.
+            if (!attrName.symbol.set()) { return unknown(); }
+            set = findAttr(set, attrName.symbol, depth + 1);
+            if (set.status != Found) { return unknown(); }
+        }
+        return set;
+    }
+
+    return r;
+}
+
+ConstantResolver::Resolution ConstantResolver::lookupVar(const Scope * scope,
+    const nix::Symbol & name, unsigned int depth)
+{
+    if (scope == nullptr || depth > maxDepth) { return unknown(); }
+
+    auto key = std::make_pair(scope, name);
+    auto it = varCache.find(key);
+    if (it != varCache.end()) { return it->second; }
+
+    // Record the variable as unknown while we work on it, so that a
+    // definition that refers to itself does not recurse forever.
+    varCache[key] = unknown();
+
+    Resolution result = unknown();
+    if (scope->lambda != nullptr)
+    {
+        // Function arguments shadow outer definitions, and their values
+        // are not known statically.
+        bool isArgument = scope->lambda->arg == name;
+        if (scope->lambda->matchAttrs && scope->lambda->formals != nullptr)
+        {
+            for (const nix::Formal & formal : scope->lambda->formals->formals)
+            {
+                if (formal.name == name) { isArgument = true; }
+            }
+        }
+        if (!isArgument)
+        {
+            result = lookupVar(scope->parent, name, depth + 1);
+        }
+    }
+    else
+    {
+        auto def = scope->attrs->attrs.find(name);
+        if (def == scope->attrs->attrs.end())
+        {
+            result = lookupVar(scope->parent, name, depth + 1);
+        }
+        else
+        {
+            Resolution value;
+            value.status = Found;
+            value.expr = def->second.e;
+            value.entry = nullptr;
+            if (def->second.inherited)
+            {
+                // "inherit x;" refers to x in the enclosing scope.
+                value.scope = scope->parent;
+                value.pos = nullptr;
+            }
+            else
+            {
+                value.scope = scope;
+                value.pos = &def->second.pos;
+            }
+            result = resolve(value, depth + 1);
+        }
+    }
+
+    varCache[key] = result;
+    return result;
+}
+
+// Finds an attribute of an expression that evaluates to an attribute set.
+// Like variables, lookups are cached, so selecting from a large set that
+// many call sites share only walks the set's definition once.
+ConstantResolver::Resolution ConstantResolver::findAttr(const Resolution & set,
+    const nix::Symbol & name, unsigned int depth)
+{
+    if (set.status != Found || depth > maxDepth) { return unknown(); }
+
+    auto key = std::make_tuple(set.scope, set.expr, name);
+    auto it = attrCache.find(key);
+    if (it != attrCache.end()) { return it->second; }
+
+    // Record the attribute as unknown while we work on it, in case it
+    // refers to itself.
+    attrCache[key] = unknown();
+    Resolution result = findAttrUncached(set, name, depth);
+    attrCache[key] = result;
+    return result;
+}
+
+ConstantResolver::Resolution ConstantResolver::findAttrUncached(
+    const Resolution & set, const nix::Symbol & name, unsigned int depth)
+{
+    auto * attrs = dynamic_cast<const nix::ExprAttrs *>(set.expr);
+    if (attrs != nullptr)
+    {
+        auto def = attrs->attrs.find(name);
+        if (def != attrs->attrs.end())
+        {
+            Resolution value;
+            value.status = Found;
+            value.expr = def->second.e;
+            value.entry = nullptr;
+            if (def->second.inherited)
+            {
+                value.scope = set.scope;
+                value.pos = nullptr;
+            }
+            else
+            {
+                value.scope = attrs->recursive ? recScope(set.scope, attrs) : set.scope;
+                value.pos = &def->second.pos;
+            }
+            Resolution result = resolve(value, depth + 1);
+            result.entry = def->second.e;
+            return result;
+        }
+
+        // A dynamic attribute might have the name we are looking for.
+        if (!attrs->dynamicAttrs.empty()) { return unknown(); }
+
+        Resolution absent = unknown();
+        absent.status = Absent;
+        return absent;
+    }
+
+    // In "a // b", attributes of b take priority over those of a.
+    auto * update = dynamic_cast<const nix::ExprOpUpdate *>(set.expr);
+    if (update != nullptr)
+    {
+        Resolution right = set;
+        right.expr = update->e2;
+        right.pos = nullptr;
+        Resolution result = findAttr(resolve(right, depth + 1), name, depth + 1);
+        if (result.status != Absent) { return result; }
+
+        Resolution left = set;
+        left.expr = update->e1;
+        left.pos = nullptr;
+        return findAttr(resolve(left, depth + 1), name, depth + 1);
+    }
+
+    return unknown();
+}
+
+std::pair<ExprStringAndPos, bool> ConstantResolver::findStringAttr(
+    const nix::Expr * attrs, const std::string & name)
+{
+    std::pair<ExprStringAndPos, bool> result;
+    Resolution value = findAttr(resolve(here(attrs), 0), symbols.create(name), 0);
+    if (value.status != Found || value.pos == nullptr) { return result; }
+
+    std::string str;
+    if (!tryGetLiteralString(value.expr, str)) { return result; }
+
+    // The expression in the attribute set is how the call uses the
+    // literal, so it does not count against onlyUsedAsArgument.
+    argumentUses.insert(value.entry);
+
+    result.first.expr = value.expr;
+    result.first.value = str;
+    result.first.pos = *value.pos;
+    result.second = true;
+    return result;
+}
+
+bool ConstantResolver::findBoolAttr(const nix::Expr * attrs,
+    const std::string & name, bool & value)
+{
+    Resolution attr = findAttr(resolve(here(attrs), 0), symbols.create(name), 0);
+    if (attr.status == Absent) { return true; }
+    if (attr.status != Found) { return false; }
+
+    // resolve() only stops at a variable if it is the builtin true or
+    // false.
+    auto * var = dynamic_cast<const nix::ExprVar *>(attr.expr);
+    if (var == nullptr) { return false; }
+    const std::string & varName = var->name;
+    value = varName == "true";
+    return true;
+}
+
+// Let and rec bindings are not uses by themselves: what counts is where
+// the variables they define are used.
+void ConstantResolver::recordBindings(const nix::ExprAttrs * attrs)
+{
+    for (auto & symbolAndAttr : attrs->attrs)
+    {
+        bindings.insert(symbolAndAttr.second.e);
+    }
+}
+
+void ConstantResolver::recordUse(const nix::Expr * e)
+{
+    if (bindings.count(e)) { return; }
+
+    Resolution r = resolve(here(e), 0);
+    if (r.status != Found || r.pos == nullptr) { return; }
+
+    std::string str;
+    if (!tryGetLiteralString(r.expr, str)) { return; }
+    literalUses[r.expr].push_back(e);
+}
+
+bool ConstantResolver::onlyUsedAsArgument(const nix::Expr * literal) const
+{
+    auto it = literalUses.find(literal);
+    if (it == literalUses.end()) { return true; }
+    for (const nix::Expr * use : it->second)
+    {
+        if (!argumentUses.count(use)) { return false; }
+    }
+    return true;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "expr-helpers.hh"
+#include "libupdate.hh"
+
+#include <deque>
+#include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+
+/** Works out which string literal an attribute is bound to, following
+ * let bindings, inherit, rec attribute sets, attribute selections and
+ * simple // merges back to the definition of the literal.  Lookups are
+ * memoized per scope, and attributes are looked up by symbol, so
+ * resolving every call site in a file takes roughly linear time.
+ *
+ * Scopes are tracked while walking the file with search(), so
+ * findStringAttr must be called from the visitor passed to search(). */
+class ConstantResolver
+{
+public:
+    /** The symbol table must be the one the expressions were parsed
+     * with. */
+    explicit ConstantResolver(nix::SymbolTable & symbols);
+
+    /** Visits every expression in e in depth-first order, like
+     * ExprDepthFirstSearch, while keeping track of the variables that
+     * are in scope. */
+    void search(nix::Expr * e, ExprVisitorBase * visitor);
+
+    /** Finds the attribute with the given name in an expression that
+     * evaluates to an attribute set, as seen from the expression
+     * currently being visited.  On success, the result holds the
+     * literal's value and the position of the attribute definition that
+     * contains the literal, which may be far from the call site. */
+    std::pair<ExprStringAndPos, bool> findStringAttr(const nix::Expr * attrs,
+        const std::string & name);
+
+    /** Finds an attribute that is set to true or false, the same way as
+     * findStringAttr.  If the set does not have the attribute, value is
+     * left alone, so it can hold the default.  Returns false if the
+     * value cannot be told without evaluating the file. */
+    bool findBoolAttr(const nix::Expr * attrs, const std::string & name,
+        bool & value);
+
+    /** After search() has finished, tells whether a literal found by
+     * findStringAttr is only referred to by the attribute sets passed to
+     * findStringAttr.  A literal bound with let that is also used
+     * somewhere else, for example in name = "foo-${rev}", would change
+     * there too if it were rewritten. */
+    bool onlyUsedAsArgument(const nix::Expr * literal) const;
+
+private:
+    // A scope that can bind variables: a let or rec attribute set, or
+    // the arguments of a function.
+    struct Scope
+    {
+        const Scope * parent;
+        const nix::ExprAttrs * attrs;
+        const nix::ExprLambda * lambda;
+    };
+
+    enum Status { Unknown, Absent, Found };
+
+    // An expression along with the scope it is evaluated in and the
+    // position of the attribute definition it came from, if any.  For
+    // the result of findAttr, entry is the unresolved expression that the
+    // attribute is defined as in the set.
+    struct Resolution
+    {
+        Status status;
+        const nix::Expr * expr;
+        const Scope * scope;
+        const nix::Pos * pos;
+        const nix::Expr * entry;
+    };
+
+    class Search;
+
+    static Resolution unknown();
+    Resolution here(const nix::Expr * e) const;
+    static bool isBound(const Scope * scope, const nix::Symbol & name);
+    Resolution resolve(const Resolution & r, unsigned int depth);
+    Resolution lookupVar(const Scope * scope, const nix::Symbol & name,
+        unsigned int depth);
+    Resolution findAttr(const Resolution & set, const nix::Symbol & name,
+        unsigned int depth);
+    Resolution findAttrUncached(const Resolution & set, const nix::Symbol & name,
+        unsigned int depth);
+    const Scope * newScope(const Scope * parent, const nix::ExprAttrs * attrs,
+        const nix::ExprLambda * lambda);
+    const Scope * recScope(const Scope * parent, const nix::ExprAttrs * attrs);
+    void recordBindings(const nix::ExprAttrs * attrs);
+    void recordUse(const nix::Expr * e);
+
+    std::deque<Scope> scopes;
+    std::map<std::pair<const Scope *, const nix::ExprAttrs *>, const Scope *> recScopes;
+    nix::SymbolTable & symbols;
+    std::map<std::pair<const Scope *, nix::Symbol>, Resolution> varCache;
+    std::map<std::tuple<const Scope *, const nix::Expr *, nix::Symbol>,
+        Resolution> attrCache;
+    const Scope * current;
+
+    // The variables and selections that resolve to each literal, and the
+    // ones that are arguments of the calls found.
+    std::set<const nix::Expr *> bindings;
+    std::set<const nix::Expr *> argumentUses;
+    std::map<const nix::Expr *, std::vector<const nix::Expr *>> literalUses;
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "trace.hh"
+
 #include <nixexpr.hh>
 
 #include <memory>
@@ -16,31 +18,44 @@ public:
     virtual void visit(nix::Expr * e)
     {
         if (e == nullptr) { return visitNull(); }
-        if (dynamic_cast<nix::ExprInt *>(e)) { return visit((nix::ExprInt *)e); }
-        if (dynamic_cast<nix::ExprString *>(e)) { return visit((nix::ExprString *)e); }
-        if (dynamic_cast<nix::ExprIndStr *>(e)) { return visit((nix::ExprIndStr *)e); }
-        if (dynamic_cast<nix::ExprPath *>(e)) { return visit((nix::ExprPath *)e); }
-        if (dynamic_cast<nix::ExprVar *>(e)) { return visit((nix::ExprVar *)e); }
-        if (dynamic_cast<nix::ExprSelect *>(e)) { return visit((nix::ExprSelect *)e); }
-        if (dynamic_cast<nix::ExprOpHasAttr *>(e)) { return visit((nix::ExprOpHasAttr *)e); }
-        if (dynamic_cast<nix::ExprAttrs *>(e)) { return visit((nix::ExprAttrs *)e); }
-        if (dynamic_cast<nix::ExprList *>(e)) { return visit((nix::ExprList *)e); }
-        if (dynamic_cast<nix::ExprLambda *>(e)) { return visit((nix::ExprLambda *)e); }
-        if (dynamic_cast<nix::ExprLet *>(e)) { return visit((nix::ExprLet *)e); }
-        if (dynamic_cast<nix::ExprWith *>(e)) { return visit((nix::ExprWith *)e); }
-        if (dynamic_cast<nix::ExprIf *>(e)) { return visit((nix::ExprIf *)e); }
-        if (dynamic_cast<nix::ExprAssert *>(e)) { return visit((nix::ExprAssert *)e); }
-        if (dynamic_cast<nix::ExprOpNot *>(e)) { return visit((nix::ExprOpNot *)e); }
-        if (dynamic_cast<nix::ExprApp *>(e)) { return visit((nix::ExprApp *)e); }
-        if (dynamic_cast<nix::ExprOpEq *>(e)) { return visit((nix::ExprOpEq *)e); }
-        if (dynamic_cast<nix::ExprOpNEq *>(e)) { return visit((nix::ExprOpNEq *)e); }
-        if (dynamic_cast<nix::ExprOpAnd *>(e)) { return visit((nix::ExprOpAnd *)e); }
-        if (dynamic_cast<nix::ExprOpOr *>(e)) { return visit((nix::ExprOpOr *)e); }
-        if (dynamic_cast<nix::ExprOpImpl *>(e)) { return visit((nix::ExprOpImpl *)e); }
-        if (dynamic_cast<nix::ExprOpUpdate *>(e)) { return visit((nix::ExprOpUpdate *)e); }
-        if (dynamic_cast<nix::ExprOpConcatLists *>(e)) { return visit((nix::ExprOpConcatLists *)e); }
-        if (dynamic_cast<nix::ExprConcatStrings *>(e)) { return visit((nix::ExprConcatStrings *)e); }
-        if (dynamic_cast<nix::ExprPos *>(e)) { return visit((nix::ExprPos *)e); }
+        traceCount(counterNodesVisited);
+
+        // Try each type in turn, keeping count of the casts for tracing.
+        unsigned int casts = 0;
+#define TRY_VISIT(T) \
+        casts++; \
+        if (dynamic_cast<nix::T *>(e)) \
+        { \
+            traceCount(counterDynamicCasts, casts); \
+            return visit((nix::T *)e); \
+        }
+        TRY_VISIT(ExprInt)
+        TRY_VISIT(ExprString)
+        TRY_VISIT(ExprIndStr)
+        TRY_VISIT(ExprPath)
+        TRY_VISIT(ExprVar)
+        TRY_VISIT(ExprSelect)
+        TRY_VISIT(ExprOpHasAttr)
+        TRY_VISIT(ExprAttrs)
+        TRY_VISIT(ExprList)
+        TRY_VISIT(ExprLambda)
+        TRY_VISIT(ExprLet)
+        TRY_VISIT(ExprWith)
+        TRY_VISIT(ExprIf)
+        TRY_VISIT(ExprAssert)
+        TRY_VISIT(ExprOpNot)
+        TRY_VISIT(ExprApp)
+        TRY_VISIT(ExprOpEq)
+        TRY_VISIT(ExprOpNEq)
+        TRY_VISIT(ExprOpAnd)
+        TRY_VISIT(ExprOpOr)
+        TRY_VISIT(ExprOpImpl)
+        TRY_VISIT(ExprOpUpdate)
+        TRY_VISIT(ExprOpConcatLists)
+        TRY_VISIT(ExprConcatStrings)
+        TRY_VISIT(ExprPos)
+#undef TRY_VISIT
+        traceCount(counterDynamicCasts, casts);
         return visitNull();
     }
 
@@ -204,9 +219,13 @@ public:
     virtual void visit(nix::ExprLambda * e)
     {
         v->visit(e);
-        for (auto & formal : e->formals->formals)
+        // A function like "x: body" has no formals.
+        if (e->matchAttrs && e->formals != nullptr)
         {
-            visit(formal.def);
+            for (auto & formal : e->formals->formals)
+            {
+                visit(formal.def);
+            }
         }
         visit(e->body);
     }
@@ -214,6 +233,7 @@ public:
     virtual void visit(nix::ExprLet * e)
     {
         v->visit(e);
+        visit(e->attrs);
         visit(e->body);
     }
 
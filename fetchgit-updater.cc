@@ -0,0 +1,512 @@
+#include "fetchgit-updater.hh"
+#include "json-fields.hh"
+#include "locked-file.hh"
+#include "trace.hh"
+
+#include <util.hh>
+
+#include <set>
+#include <stdexcept>
+
+std::pair<FetchGitApp, bool> tryInterpretAsFetchGitApp(nix::Expr * expr,
+    ConstantResolver & resolver, StringPool & pool,
+    std::pair<const nix::Expr *, const nix::Expr *> * literals)
+{
+    std::pair<FetchGitApp, bool> result;
+    FetchGitApp & fga = result.first;
+
+    const nix::ExprApp * app = tryInterpretAsApp(expr, "fetchgit");
+    if (app == nullptr) { return result; }
+
+    auto urlResult = resolver.findStringAttr(app->e2, "url");
+    if (!urlResult.second) { return result; }
+
+    auto revResult = resolver.findStringAttr(app->e2, "rev");
+    if (!revResult.second) { return result; }
+
+    auto hashResult = resolver.findStringAttr(app->e2, "sha256");
+    if (!hashResult.second) { return result; }
+
+    fga.url = pool.intern(urlResult.first.c_str());
+    fga.rev = fga.newRev = pool.internQuoted(revResult.first.string());
+    fga.hash = fga.newHash = pool.internQuoted(hashResult.first.string());
+    fga.revLine = revResult.first.pos.line;
+    fga.revColumn = revResult.first.pos.column;
+    fga.hashLine = hashResult.first.pos.line;
+    fga.hashColumn = hashResult.first.pos.column;
+    fga.revStatus = fga.hashStatus = FetchGitApp::Rewritable;
+
+    // leaveDotGit defaults to deepClone, so that has to be found first.
+    fga.argsKnown =
+        resolver.findBoolAttr(app->e2, "fetchSubmodules", fga.args.fetchSubmodules) &&
+        resolver.findBoolAttr(app->e2, "deepClone", fga.args.deepClone);
+    fga.args.leaveDotGit = fga.args.deepClone;
+    fga.argsKnown = fga.argsKnown &&
+        resolver.findBoolAttr(app->e2, "leaveDotGit", fga.args.leaveDotGit);
+
+    if (literals != nullptr)
+    {
+        literals->first = revResult.first.expr;
+        literals->second = hashResult.first.expr;
+    }
+
+    result.second = true;
+    return result;
+}
+
+std::vector<FetchGitApp> findFetchGitApps(nix::SymbolTable & symbols,
+    nix::Expr * expr, StringPool & pool)
+{
+    TraceScope trace("findFetchGitApps");
+    std::vector<FetchGitApp> found;
+    std::vector<std::pair<const nix::Expr *, const nix::Expr *>> literals;
+    ConstantResolver resolver(symbols);
+    ExprVisitorFunction finder([&](nix::Expr * e) {
+        std::pair<const nix::Expr *, const nix::Expr *> l;
+        auto result = tryInterpretAsFetchGitApp(e, resolver, pool, &l);
+        if (result.second)
+        {
+            found.push_back(result.first);
+            literals.push_back(l);
+        }
+        return true;
+    });
+    resolver.search(expr, &finder);
+
+    // Uses of a variable can come after the call, so this has to wait
+    // until the whole expression has been searched.
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        if (!resolver.onlyUsedAsArgument(literals[i].first))
+        {
+            found[i].revStatus = FetchGitApp::UsedElsewhere;
+        }
+        if (!resolver.onlyUsedAsArgument(literals[i].second))
+        {
+            found[i].hashStatus = FetchGitApp::UsedElsewhere;
+        }
+    }
+    return found;
+}
+
+// The parser accepts values that applyReplacements cannot find the
+// literal of, such as rev = ("...").  Looking for each literal now means
+// that such a call is left alone, rather than failing the update of the
+// whole file once everything has been fetched.
+static void checkLiterals(const std::string & source,
+    std::vector<FetchGitApp> & apps, const StringPool & pool)
+{
+    TraceScope trace("checkLiterals");
+    std::vector<StringReplacement> replacements;
+    for (const FetchGitApp & fga : apps)
+    {
+        StringReplacement sr;
+        sr.line = fga.revLine;
+        sr.column = fga.revColumn;
+        sr.oldValue = pool.get(fga.rev).inner();
+        replacements.push_back(sr);
+        sr.line = fga.hashLine;
+        sr.column = fga.hashColumn;
+        sr.oldValue = pool.get(fga.hash).inner();
+        replacements.push_back(sr);
+    }
+
+    for (size_t i : findFailingReplacements(source, replacements))
+    {
+        FetchGitApp & fga = apps[i / 2];
+        if (i % 2 == 0) { fga.revStatus = FetchGitApp::NotPlainLiteral; }
+        else { fga.hashStatus = FetchGitApp::NotPlainLiteral; }
+    }
+}
+
+// Scans a file whose contents have already been read.
+static std::vector<FetchGitApp> scanFetchGitContents(nix::EvalState & state,
+    const std::string & path, const std::string & contents, StringPool & pool)
+{
+    nix::Expr * expr;
+    {
+        TraceScope trace("parseExprFromFile", path);
+        expr = state.parseExprFromFile(path);
+    }
+    std::vector<FetchGitApp> apps = findFetchGitApps(state.symbols, expr, pool);
+    checkLiterals(contents, apps, pool);
+    return apps;
+}
+
+std::vector<FetchGitApp> scanFetchGitFile(nix::EvalState & state,
+    const std::string & path, StringPool & pool)
+{
+    return scanFetchGitContents(state, path, nix::readFile(path), pool);
+}
+
+std::vector<FetchGitApp> scanFetchGitFile(nix::EvalState & state,
+    const std::string & path, StringPool & pool, std::string & contentsHash)
+{
+    LockedFile file(path, false);
+    std::string contents = file.read();
+    contentsHash = hashContents(contents);
+    return scanFetchGitContents(state, path, contents, pool);
+}
+
+std::vector<FetchGitApp> scanFetchGitString(nix::EvalState & state,
+    const std::string & source, const std::string & basePath, StringPool & pool)
+{
+    nix::Expr * expr;
+    {
+        TraceScope trace("parseExprFromString");
+        expr = state.parseExprFromString(source, basePath);
+    }
+    std::vector<FetchGitApp> apps = findFetchGitApps(state.symbols, expr, pool);
+    checkLiterals(source, apps, pool);
+    return apps;
+}
+
+// This does not touch any EvalState, so it can run on any thread.
+GitRevisionInfo prefetchGitRevision(const std::string & urlString,
+    const std::string & revString, const GitFetchArgs & args, bool quiet)
+{
+    // Prevent security problems when assembling the shell command below.
+    if (urlString.find('\'') != std::string::npos)
+    {
+        throw std::runtime_error("Git repository name has a single quote in it.");
+    }
+    if (revString.find('\'') != std::string::npos)
+    {
+        throw std::runtime_error("Git revision has a single quote in it.");
+    }
+
+    // Fetch the info from the git repository.
+    std::string cmd = "nix-prefetch-git ";
+    if (args.fetchSubmodules) { cmd += "--fetch-submodules "; }
+    if (args.deepClone) { cmd += "--deepClone "; }
+    if (args.leaveDotGit) { cmd += "--leave-dotGit "; }
+    cmd += std::string("\'") + urlString + std::string("\'");
+    if (!revString.empty())
+    {
+        cmd += std::string(" \'") + revString + std::string("\'");
+    }
+    if (quiet) { cmd += " 2>/dev/null"; }
+
+    std::string json = runShellCommand(cmd);
+
+    // Pull the fields we need out of the JSON returned from nix-prefetch-git.
+    JsonStringField fields[] = { "url", "rev", "sha256" };
+    JsonStringField & url = fields[0], & rev = fields[1], & sha256 = fields[2];
+    extractJsonStringFields(json, fields, 3);
+    for (const JsonStringField & field : fields)
+    {
+        if (!field.found)
+        {
+            throw std::runtime_error(std::string("JSON from nix-prefetch-git is "
+                "missing the key '") + field.key + "'.");
+        }
+    }
+
+    // Make sure the url from the JSON response is what we are expecting.
+    if (!url.equals(urlString))
+    {
+        throw std::runtime_error("JSON from nix-prefetch-git has a url that does "
+            "not match what we expected.");
+    }
+
+    GitRevisionInfo info;
+    info.rev = rev.value();
+    info.sha256 = sha256.value();
+    return info;
+}
+
+size_t dropConflictingUpdates(std::vector<FetchGitApp> & apps,
+    const StringPool & pool)
+{
+    typedef std::pair<uint32_t, uint32_t> Position;
+    size_t dropped = 0;
+    bool changed = true;
+    while (changed)
+    {
+        // Dropping an update can make the other literal of that call
+        // conflict, so go around until nothing changes.
+        changed = false;
+        // A call that cannot be rewritten keeps its old values.
+        std::map<Position, StringPool::Id> revs, hashes;
+        std::set<Position> conflicts;
+        for (const FetchGitApp & fga : apps)
+        {
+            Position revPos(fga.revLine, fga.revColumn);
+            Position hashPos(fga.hashLine, fga.hashColumn);
+            StringPool::Id newRev = fga.canRewrite() ? fga.newRev : fga.rev;
+            StringPool::Id newHash = fga.canRewrite() ? fga.newHash : fga.hash;
+            auto rev = revs.insert(std::make_pair(revPos, newRev)).first;
+            if (rev->second != newRev) { conflicts.insert(revPos); }
+            auto hash = hashes.insert(std::make_pair(hashPos, newHash)).first;
+            if (hash->second != newHash) { conflicts.insert(hashPos); }
+        }
+
+        for (FetchGitApp & fga : apps)
+        {
+            if (!fga.canRewrite()) { continue; }
+            if (fga.newRev == fga.rev && fga.newHash == fga.hash) { continue; }
+            bool revConflict = conflicts.count(Position(fga.revLine, fga.revColumn));
+            if (!revConflict && !conflicts.count(Position(fga.hashLine, fga.hashColumn)))
+            {
+                continue;
+            }
+            printMsg(nix::lvlInfo, "warning: not updating the call to fetchgit for " +
+                pool.get(fga.url).str() + " because its " +
+                (revConflict ? "rev" : "sha256") + " on line " +
+                std::to_string(revConflict ? fga.revLine : fga.hashLine) +
+                " is shared with a call that needs a different value");
+            fga.newRev = fga.rev;
+            fga.newHash = fga.hash;
+            dropped++;
+            changed = true;
+        }
+    }
+    return dropped;
+}
+
+void addStringReplacements(const FetchGitApp & app, const StringPool & pool,
+    std::vector<StringReplacement> & replacements)
+{
+    if (!app.canRewrite()) { return; }
+    if (app.newRev != app.rev)
+    {
+        StringReplacement sr;
+        sr.line = app.revLine;
+        sr.column = app.revColumn;
+        sr.oldValue = pool.get(app.rev).inner();
+        sr.newString = pool.get(app.newRev);
+        replacements.push_back(sr);
+    }
+    if (app.newHash != app.hash)
+    {
+        StringReplacement sr;
+        sr.line = app.hashLine;
+        sr.column = app.hashColumn;
+        sr.oldValue = pool.get(app.hash).inner();
+        sr.newString = pool.get(app.newHash);
+        replacements.push_back(sr);
+    }
+}
+
+size_t writeFetchGitApps(nix::EvalState & state, const std::string & path,
+    const std::string & contentsHash, const std::vector<FetchGitApp> & apps,
+    StringPool & pool)
+{
+    // Remember which call each replacement came from.
+    std::vector<StringReplacement> replacements;
+    std::vector<size_t> appIndex;
+    for (size_t i = 0; i < apps.size(); i++)
+    {
+        addStringReplacements(apps[i], pool, replacements);
+        appIndex.resize(replacements.size(), i);
+    }
+    if (replacements.empty()) { return 0; }
+
+    auto replan = [&](const std::string & contents,
+        const std::vector<size_t> & conflicts)
+    {
+        std::set<size_t> conflictingApps;
+        for (size_t i : conflicts) { conflictingApps.insert(appIndex[i]); }
+
+        std::vector<FetchGitApp> current = scanFetchGitString(state, contents,
+            nix::dirOf(nix::absPath(path)), pool);
+
+        std::vector<StringReplacement> result;
+        for (size_t i : conflictingApps)
+        {
+            const FetchGitApp & app = apps[i];
+            for (FetchGitApp & fga : current)
+            {
+                if (fga.url != app.url || fga.rev != app.rev) { continue; }
+                fga.newRev = app.newRev;
+                fga.newHash = app.newHash;
+                addStringReplacements(fga, pool, result);
+            }
+        }
+        return result;
+    };
+
+    return performReplacements(path, contentsHash, replacements, replan);
+}
+
+FetchGitQueue::FetchGitQueue(const FetchGitOptions & options)
+    : options(options),
+      scheduler(options.jobs, options.perHostJobs, options.perHostRate)
+{
+}
+
+FetchGitQueue::~FetchGitQueue()
+{
+    // If the caller gave up, for example because one of the fetches
+    // failed, there is no point in starting the rest.
+    cancel();
+}
+
+GitRevisionInfo FetchGitQueue::fetchNow(const std::string & url,
+    const std::string & rev, const GitFetchArgs & args)
+{
+    TraceScope trace("fetchGitRevision", url);
+    if (options.inProcess && !args.leaveDotGit)
+    {
+        try
+        {
+            return fetchGitRevision(url, rev.empty() ? "HEAD" : rev, args,
+                options.quiet);
+        }
+        catch (const UnsupportedCheckoutError & e)
+        {
+            printMsg(nix::lvlInfo, "using nix-prefetch-git for " + url + ": " +
+                e.what());
+        }
+    }
+    return prefetchGitRevision(url, rev, args, options.quiet);
+}
+
+std::shared_future<GitRevisionInfo> FetchGitQueue::fetch(const std::string & url,
+    const std::string & rev, const GitFetchArgs & args)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Key key(url, rev, args);
+    auto it = fetches.find(key);
+    if (it != fetches.end()) { return it->second.future; }
+
+    // std::function needs a copyable job, so the promise is shared.
+    auto promise = std::make_shared<std::promise<GitRevisionInfo>>();
+    InFlight & inFlight = fetches[key];
+    inFlight.future = promise->get_future().share();
+    inFlight.id = nextFetchId++;
+    unsigned long id = inFlight.id;
+    scheduler.submit(hostFromUrl(url), [this, key, id, promise]() {
+        try
+        {
+            promise->set_value(fetchNow(std::get<0>(key), std::get<1>(key),
+                std::get<2>(key)));
+        }
+        catch (...)
+        {
+            promise->set_exception(std::current_exception());
+            forget(key, id);
+            throw;
+        }
+        forget(key, id);
+    });
+    return inFlight.future;
+}
+
+// Stops sharing a fetch once it is done, unless clear() has already
+// dropped it and a newer fetch of the same revision has taken its place.
+void FetchGitQueue::forget(const Key & key, unsigned long id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = fetches.find(key);
+    if (it != fetches.end() && it->second.id == id) { fetches.erase(it); }
+}
+
+void FetchGitQueue::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    fetches.clear();
+}
+
+void FetchGitQueue::cancel()
+{
+    clear();
+    scheduler.cancelPending();
+}
+
+void FetchGitQueue::fetch(const std::string & url, const std::string & rev,
+    const GitFetchArgs & args, const Callback & callback)
+{
+    scheduler.submit(hostFromUrl(url), [this, url, rev, args, callback]() {
+        GitRevisionInfo info;
+        std::exception_ptr error;
+        try
+        {
+            info = fetchNow(url, rev, args);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        callback(info, error);
+        if (error) { std::rethrow_exception(error); }
+    });
+}
+
+void FetchGitQueue::wait()
+{
+    scheduler.wait();
+}
+
+void FetchGitQueue::printStats(std::ostream & stream) const
+{
+    scheduler.printStats(stream);
+}
+
+// Gets the literal to write for a new value, or the old literal if the
+// value has not changed, so that it is not rewritten.
+static StringPool::Id newLiteral(StringPool & pool, StringPool::Id old,
+    const std::string & value)
+{
+    if (pool.get(old).inner() == StringRef(value.data(), value.size())) { return old; }
+    return pool.intern(encodeStringLiteral(value));
+}
+
+static const char * literalProblem(FetchGitApp::LiteralStatus status)
+{
+    if (status == FetchGitApp::UsedElsewhere) { return " is also used elsewhere"; }
+    return " is not a plain string literal";
+}
+
+// Checks whether a call can be updated, and warns if it cannot.
+static bool canUpdate(const FetchGitApp & fga, const StringPool & pool)
+{
+    std::string reason;
+    if (fga.revStatus != FetchGitApp::Rewritable)
+    {
+        reason = "its rev on line " + std::to_string(fga.revLine) +
+            literalProblem(fga.revStatus);
+    }
+    else if (fga.hashStatus != FetchGitApp::Rewritable)
+    {
+        reason = "its sha256 on line " + std::to_string(fga.hashLine) +
+            literalProblem(fga.hashStatus);
+    }
+    else if (!fga.argsKnown)
+    {
+        reason = "its fetchSubmodules, deepClone or leaveDotGit is not simply "
+            "true or false, so its hash cannot be computed";
+    }
+    else
+    {
+        return true;
+    }
+    printMsg(nix::lvlInfo, "warning: not updating the call to fetchgit for " +
+        pool.get(fga.url).str() + " because " + reason);
+    return false;
+}
+
+void updateFetchGitApps(FetchGitQueue & queue, std::vector<FetchGitApp> & apps,
+    StringPool & pool)
+{
+    // Start all the fetches before waiting for any of them.
+    std::vector<std::shared_future<GitRevisionInfo>> results;
+    for (const FetchGitApp & fga : apps)
+    {
+        if (!canUpdate(fga, pool))
+        {
+            results.push_back(std::shared_future<GitRevisionInfo>());
+            continue;
+        }
+        results.push_back(queue.fetch(pool.get(fga.url).str(), "", fga.args));
+    }
+
+    for (size_t i = 0; i < apps.size(); i++)
+    {
+        if (!results[i].valid()) { continue; }
+        const GitRevisionInfo & info = results[i].get();
+        apps[i].newRev = newLiteral(pool, apps[i].rev, info.rev);
+        apps[i].newHash = newLiteral(pool, apps[i].hash, info.sha256);
+    }
+    dropConflictingUpdates(apps, pool);
+}
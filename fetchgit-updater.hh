@@ -0,0 +1,261 @@
+#pragma once
+
+#include "constant-resolver.hh"
+#include "git-hash.hh"
+#include "host-scheduler.hh"
+#include "libupdate.hh"
+#include "string-pool.hh"
+
+#include <eval.hh>
+
+#include <exception>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
+
+// This is the interface for programs that want to embed the updater.  A
+// typical update of one file looks like this:
+//
+//   StringPool pool;
+//   auto apps = scanFetchGitFile(state, path, pool);
+//   FetchGitQueue queue;
+//   updateFetchGitApps(queue, apps, pool);
+//   std::vector<StringReplacement> replacements;
+//   for (auto & app : apps) { addStringReplacements(app, pool, replacements); }
+//   performReplacements(path, replacements);
+//
+// To let several runners share one file, scan it with the overload of
+// scanFetchGitFile that returns a hash of its contents, and write it back
+// with writeFetchGitApps instead.
+//
+// Thread safety: a nix::EvalState must only be used by one thread at a
+// time, so scanning is not thread-safe with respect to the EvalState
+// passed in.  StringPool and FetchGitQueue can be used from any number of
+// threads.  applyReplacements and the other free functions only touch
+// their arguments.  FetchGitApp records are plain values and are not
+// synchronized.
+
+/** A call to fetchgit in a file.  The strings are stored in a StringPool
+ * and referred to by id, so a record stays small however long its URL
+ * is, and repeated values are only stored once.  The rev and hash strings
+ * are the values of the literals with quotes around them (see
+ * StringPool::internQuoted), and the positions are those of the attribute
+ * definitions.  newRev and newHash start out equal to rev and hash,
+ * meaning no change.  To change them, set them to the text of the new
+ * literals as it should appear in the file, quotes and escapes included,
+ * such as the result of encodeStringLiteral; updateFetchGitApps does
+ * this.  revStatus and hashStatus tell whether the literals can be
+ * rewritten; if either cannot, the call is not updated.  args holds the
+ * other arguments of the call that change the hash, and argsKnown is
+ * false if one of them is not simply true or false, in which case the
+ * hash of the call cannot be computed. */
+struct FetchGitApp
+{
+    /** Whether a rev or sha256 literal can be rewritten, and if not,
+     * why. */
+    enum LiteralStatus
+    {
+        Rewritable,
+
+        /** The literal is bound with let or rec and is also used outside
+         * the arguments of calls to fetchgit, as in name = "foo-${rev}",
+         * so rewriting it would change those uses too. */
+        UsedElsewhere,
+
+        /** The value is not written as a plain string literal where the
+         * attribute is defined, as in rev = ("..."), so the literal
+         * cannot be found in the source. */
+        NotPlainLiteral,
+    };
+
+    StringPool::Id url;
+    StringPool::Id rev, hash;
+    StringPool::Id newRev, newHash;
+    uint32_t revLine, revColumn;
+    uint32_t hashLine, hashColumn;
+    LiteralStatus revStatus, hashStatus;
+    GitFetchArgs args;
+    bool argsKnown;
+
+    bool canRewrite() const
+    {
+        return revStatus == Rewritable && hashStatus == Rewritable;
+    }
+};
+
+/** Checks whether an expression is a call to fetchgit whose url, rev and
+ * sha256 arguments are all string literals.  The arguments can be given
+ * directly, or come from let bindings, inherit, or a // merge; the
+ * resolver follows them back to the literals, and finds fetchSubmodules,
+ * deepClone and leaveDotGit the same way.  If literals is not null, it
+ * is set to the rev and sha256 literal expressions. */
+std::pair<FetchGitApp, bool> tryInterpretAsFetchGitApp(nix::Expr * expr,
+    ConstantResolver & resolver, StringPool & pool,
+    std::pair<const nix::Expr *, const nix::Expr *> * literals = nullptr);
+
+/** Finds all the calls to fetchgit in an expression that was parsed with
+ * the given symbol table.  The status of a rev or sha256 literal that is
+ * also used outside the arguments of calls to fetchgit is set to
+ * UsedElsewhere. */
+std::vector<FetchGitApp> findFetchGitApps(nix::SymbolTable & symbols,
+    nix::Expr * expr, StringPool & pool);
+
+/** Parses a .nix file and finds all the calls to fetchgit in it.  The
+ * literals of each call are looked for in the file the way
+ * applyReplacements will look for them, to set revStatus and
+ * hashStatus. */
+std::vector<FetchGitApp> scanFetchGitFile(nix::EvalState & state,
+    const std::string & path, StringPool & pool);
+
+/** Like scanFetchGitFile, but also gets the hashContents of the file as
+ * it was parsed, for passing to writeFetchGitApps.  The file is locked
+ * while it is read, so runners that use writeFetchGitApps cannot change
+ * it in the middle. */
+std::vector<FetchGitApp> scanFetchGitFile(nix::EvalState & state,
+    const std::string & path, StringPool & pool, std::string & contentsHash);
+
+/** Parses .nix source code held in memory and finds all the calls to
+ * fetchgit in it, like scanFetchGitFile.  Relative paths in the source
+ * are resolved against basePath.  The positions in the results can be
+ * passed to applyReplacements along with the same source. */
+std::vector<FetchGitApp> scanFetchGitString(nix::EvalState & state,
+    const std::string & source, const std::string & basePath, StringPool & pool);
+
+/** Uses nix-prefetch-git to fetch a revision of a git repository the way
+ * fetchgit would with the given arguments.  If rev is empty,
+ * nix-prefetch-git picks the latest one.  (Requires internet access.) */
+GitRevisionInfo prefetchGitRevision(const std::string & url,
+    const std::string & rev, const GitFetchArgs & args, bool quiet);
+
+/** Several calls to fetchgit can share a rev or sha256 literal bound with
+ * let.  If they need different new values, or one of them cannot be
+ * rewritten, the literal cannot be rewritten for all of them, so this
+ * resets newRev and newHash of each of those calls to the old values,
+ * with a warning.  updateFetchGitApps calls this; callers that set newRev
+ * and newHash themselves should too.  Returns the number of calls
+ * reset. */
+size_t dropConflictingUpdates(std::vector<FetchGitApp> & apps,
+    const StringPool & pool);
+
+/** Adds the replacements needed to update a call to fetchgit to its
+ * newRev and newHash, unless its literals cannot be rewritten.  The
+ * strings point into the pool, so nothing is copied, and the pool must
+ * outlive the replacements. */
+void addStringReplacements(const FetchGitApp & app, const StringPool & pool,
+    std::vector<StringReplacement> & replacements);
+
+/** Writes the newRev and newHash of each call to fetchgit back to the
+ * file it was scanned from, using the compare-and-swap form of
+ * performReplacements so that several runners can update one file at
+ * once.  contentsHash comes from scanFetchGitFile.  If another runner
+ * changed the file since it was scanned, the calls whose replacements no
+ * longer fit are found again in the current contents by URL and old
+ * revision; calls that another runner has already moved to a different
+ * revision are left alone.  Returns the number of replacements that had
+ * to be re-planned. */
+size_t writeFetchGitApps(nix::EvalState & state, const std::string & path,
+    const std::string & contentsHash, const std::vector<FetchGitApp> & apps,
+    StringPool & pool);
+
+/** Settings for fetching git repositories. */
+struct FetchGitOptions
+{
+    /** Suppresses the output of git and nix-prefetch-git. */
+    bool quiet = false;
+
+    /** Hashes repositories with fetchGitRevision instead of running
+     * nix-prefetch-git, except for the commits that fetchGitRevision
+     * cannot hash (see UnsupportedCheckoutError). */
+    bool inProcess = false;
+
+    /** The most fetches to run at once, in total and for each host, and
+     * the most fetches to start per second for each host.  See
+     * HostScheduler. */
+    unsigned int jobs = std::thread::hardware_concurrency();
+    unsigned int perHostJobs = 0;
+    double perHostRate = 0;
+};
+
+/** Fetches git revisions in the background on a HostScheduler, so the
+ * caller can get on with other work while they run.  Every method can be
+ * called from any thread.  Destroying the queue cancels the fetches that
+ * have not started and waits for the ones that are running. */
+class FetchGitQueue
+{
+public:
+    /** Called with the result of a fetch, or with an error and an empty
+     * GitRevisionInfo if the fetch failed.  The callback runs on one of
+     * the queue's threads and must not throw or call wait(). */
+    typedef std::function<void(const GitRevisionInfo & info,
+        std::exception_ptr error)> Callback;
+
+    explicit FetchGitQueue(const FetchGitOptions & options = FetchGitOptions());
+    ~FetchGitQueue();
+
+    /** Starts fetching a revision of a repository the way fetchgit would
+     * with the given arguments, or the latest revision if rev is empty,
+     * and returns a future for the result.  A fetch of a URL and revision
+     * with the same arguments that is already queued or running shares
+     * its result; once a fetch has finished, whether it worked or not,
+     * the queue forgets it, so fetching it again starts a new fetch. */
+    std::shared_future<GitRevisionInfo> fetch(const std::string & url,
+        const std::string & rev, const GitFetchArgs & args);
+
+    /** Like fetch, but calls the callback when the fetch is done instead
+     * of returning a future.  Results are not shared with other fetches. */
+    void fetch(const std::string & url, const std::string & rev,
+        const GitFetchArgs & args, const Callback & callback);
+
+    /** Stops sharing the fetches that are in flight, so later calls to
+     * fetch start new ones.  The futures already returned still get
+     * their results. */
+    void clear();
+
+    /** Drops the fetches that have not started yet.  Their futures get a
+     * std::future_error with std::future_errc::broken_promise, and their
+     * callbacks are not called.  Fetches that are running are left to
+     * finish, but are no longer shared, as with clear(). */
+    void cancel();
+
+    /** Blocks until every fetch started so far has finished. */
+    void wait();
+
+    /** Prints the throughput of each host so far. */
+    void printStats(std::ostream & stream) const;
+
+private:
+    // A fetch that is queued or running, and a number that tells it
+    // apart from later fetches of the same revision.
+    struct InFlight
+    {
+        std::shared_future<GitRevisionInfo> future;
+        unsigned long id;
+    };
+
+    typedef std::tuple<std::string, std::string, GitFetchArgs> Key;
+
+    GitRevisionInfo fetchNow(const std::string & url, const std::string & rev,
+        const GitFetchArgs & args);
+    void forget(const Key & key, unsigned long id);
+
+    FetchGitOptions options;
+    std::mutex mutex;
+    std::map<Key, InFlight> fetches;
+    unsigned long nextFetchId = 0;
+
+    // This is last so that it is destroyed first, finishing the jobs that
+    // refer to the other members.
+    HostScheduler scheduler;
+};
+
+/** Fetches the latest revision of every call to fetchgit and stores it in
+ * newRev and newHash, leaving out calls that share literals with
+ * conflicting updates (see dropConflictingUpdates).  Calls whose
+ * literals cannot be rewritten or whose arguments are not known are not
+ * fetched, and are left alone with a warning.  This blocks until the
+ * fetches are done, and throws the first error in the order of the
+ * calls. */
+void updateFetchGitApps(FetchGitQueue & queue, std::vector<FetchGitApp> & apps,
+    StringPool & pool);
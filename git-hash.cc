@@ -0,0 +1,454 @@
+#include "git-hash.hh"
+#include "libupdate.hh"
+#include "trace.hh"
+
+#include <hash.hh>
+#include <serialise.hh>
+#include <util.hh>
+
+#include <stdio.h>
+#include <map>
+#include <sstream>
+#include <system_error>
+#include <vector>
+
+// Quotes an argument for use in a shell command.  Like the rest of this
+// program, we simply refuse arguments that contain single quotes.
+static std::string shellQuote(const std::string & arg)
+{
+    if (arg.find('\'') != std::string::npos)
+    {
+        throw std::runtime_error("Shell argument has a single quote in it: " + arg);
+    }
+    return "'" + arg + "'";
+}
+
+// Removes the trailing newline from the output of a command.
+static std::string chomp(std::string str)
+{
+    while (!str.empty() && (str.back() == '\n' || str.back() == '\r'))
+    {
+        str.pop_back();
+    }
+    return str;
+}
+
+namespace
+{
+    // A file or directory in the tree of a git commit, as it would look
+    // after being checked out.
+    struct GitTreeNode
+    {
+        enum Type { Directory, Regular, Executable, Symlink };
+
+        Type type = Directory;
+
+        // The id of the blob holding the contents of a regular file or
+        // the target of a symlink.
+        std::string blob;
+
+        // Whether a directory is where a submodule goes.
+        bool submodule = false;
+
+        // The entries of a directory.  std::map sorts the names bytewise,
+        // which is the order that the NAR format requires.
+        std::map<std::string, GitTreeNode> children;
+    };
+
+    // Reads the objects printed by "git cat-file --batch".
+    class CatFileReader
+    {
+        FILE * fp;
+
+    public:
+        CatFileReader(const std::string & cmd)
+        {
+            fp = popen(cmd.c_str(), "r");
+            if (fp == nullptr)
+            {
+                int ev = errno;
+                std::string what = std::string("Failed to start command: ") + cmd;
+                throw std::system_error(ev, std::system_category(), what);
+            }
+        }
+
+        ~CatFileReader()
+        {
+            if (fp != nullptr) { pclose(fp); }
+        }
+
+        // Reads the header line of the next object, which must have the
+        // given id, and returns the size of the object.
+        uint64_t readHeader(const std::string & id)
+        {
+            // The header is "<id> <type> <size>\n", or "<id> missing\n".
+            char line[256];
+            if (fgets(line, sizeof(line), fp) == nullptr)
+            {
+                throw std::runtime_error("Unexpected end of output from git cat-file.");
+            }
+            std::istringstream stream(line);
+            std::string gotId, type;
+            uint64_t size = 0;
+            stream >> gotId >> type >> size;
+            if (stream.fail() || gotId != id)
+            {
+                throw std::runtime_error("Unexpected output from git cat-file "
+                    "for object " + id + ".");
+            }
+            return size;
+        }
+
+        // Copies the contents of the current object to the sink.
+        void copyContents(uint64_t size, nix::Sink & sink)
+        {
+            unsigned char buffer[65536];
+            while (size > 0)
+            {
+                size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+                size_t count = fread(buffer, 1, chunk, fp);
+                if (count == 0)
+                {
+                    throw std::runtime_error("Unexpected end of output from git cat-file.");
+                }
+                sink(buffer, count);
+                traceCount(counterBytesRead, count);
+                size -= count;
+            }
+
+            // Each object is followed by a newline.
+            if (fgetc(fp) != '\n')
+            {
+                throw std::runtime_error("Unexpected output from git cat-file.");
+            }
+        }
+
+        void close()
+        {
+            int ret = pclose(fp);
+            fp = nullptr;
+            if (ret != 0)
+            {
+                throw std::runtime_error("git cat-file failed");
+            }
+        }
+    };
+}
+
+// Adds an entry from "git ls-tree -r" to the tree, creating the
+// directories that lead to it, and returns it.
+static GitTreeNode & addTreeEntry(GitTreeNode & root, const std::string & path,
+    GitTreeNode::Type type, const std::string & blob)
+{
+    GitTreeNode * dir = &root;
+    size_t start = 0;
+    while (1)
+    {
+        size_t slash = path.find('/', start);
+        if (slash == std::string::npos) { break; }
+        dir = &dir->children[path.substr(start, slash - start)];
+        start = slash + 1;
+    }
+
+    GitTreeNode & node = dir->children[path.substr(start)];
+    node.type = type;
+    node.blob = blob;
+    return node;
+}
+
+// Parses the NUL-separated output of "git ls-tree -r -z".  Each record
+// looks like "<mode> <type> <id>\t<path>".
+static GitTreeNode parseTreeListing(const std::string & listing)
+{
+    GitTreeNode root;
+    size_t start = 0;
+    while (start < listing.size())
+    {
+        size_t end = listing.find('\0', start);
+        if (end == std::string::npos) { end = listing.size(); }
+        std::string record = listing.substr(start, end - start);
+        start = end + 1;
+
+        size_t space1 = record.find(' ');
+        size_t space2 = record.find(' ', space1 + 1);
+        size_t tab = record.find('\t');
+        if (space1 == std::string::npos || space2 == std::string::npos ||
+            tab == std::string::npos || tab < space2)
+        {
+            throw std::runtime_error("Unexpected output from git ls-tree.");
+        }
+        std::string mode = record.substr(0, space1);
+        std::string id = record.substr(space2 + 1, tab - space2 - 1);
+        std::string path = record.substr(tab + 1);
+
+        if (mode == "120000")
+        {
+            addTreeEntry(root, path, GitTreeNode::Symlink, id);
+        }
+        else if (mode == "160000")
+        {
+            // A submodule.  nix-prefetch-git leaves an empty directory
+            // for it unless it was asked to fetch submodules.
+            addTreeEntry(root, path, GitTreeNode::Directory, "").submodule = true;
+        }
+        else if (mode == "100755")
+        {
+            addTreeEntry(root, path, GitTreeNode::Executable, id);
+        }
+        else
+        {
+            addTreeEntry(root, path, GitTreeNode::Regular, id);
+        }
+    }
+    return root;
+}
+
+// Lists the blobs in the order in which writeNarNode will need them.
+static void collectBlobs(const GitTreeNode & node, std::string & list)
+{
+    if (node.type == GitTreeNode::Directory)
+    {
+        for (auto & nameAndChild : node.children)
+        {
+            collectBlobs(nameAndChild.second, list);
+        }
+    }
+    else
+    {
+        list += node.blob;
+        list += '\n';
+    }
+}
+
+// Lists the .gitattributes files in the tree, with their paths.
+static void collectAttributeFiles(const GitTreeNode & node, const std::string & path,
+    std::vector<std::pair<std::string, std::string>> & files)
+{
+    for (auto & nameAndChild : node.children)
+    {
+        const GitTreeNode & child = nameAndChild.second;
+        std::string childPath = path + nameAndChild.first;
+        if (child.type == GitTreeNode::Directory)
+        {
+            collectAttributeFiles(child, childPath + "/", files);
+        }
+        else if (nameAndChild.first == ".gitattributes" &&
+            child.type != GitTreeNode::Symlink)
+        {
+            files.push_back(std::make_pair(childPath, child.blob));
+        }
+    }
+}
+
+// Finds the first attribute in a .gitattributes file that makes git change
+// files as it checks them out, or returns an empty string if there is
+// none.  Each line is a pattern followed by attributes, which can be set
+// ("text", "eol=crlf"), unset ("-text") or unspecified ("!text"); only
+// setting one changes anything.  Macro definitions ("[attr]name ...") are
+// checked the same way, in case a pattern uses them.
+static std::string findCheckoutAttribute(const std::string & attributes)
+{
+    static const char * const checkoutAttributes[] = {
+        "text", "eol", "crlf", "ident", "filter", "working-tree-encoding",
+    };
+
+    std::istringstream lines(attributes);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        std::istringstream words(line);
+        std::string pattern, attribute;
+        words >> pattern;
+        if (pattern.empty() || pattern[0] == '#') { continue; }
+        while (words >> attribute)
+        {
+            if (attribute[0] == '-' || attribute[0] == '!') { continue; }
+            std::string name = attribute.substr(0, attribute.find('='));
+            for (const char * checkoutAttribute : checkoutAttributes)
+            {
+                if (name == checkoutAttribute) { return attribute; }
+            }
+        }
+    }
+    return "";
+}
+
+// The .git directory that fetchgit keeps with leaveDotGit is not made
+// from the objects of the commit alone, so it cannot be hashed here.
+static void checkDotGitDropped(const GitFetchArgs & args)
+{
+    if (args.leaveDotGit)
+    {
+        throw UnsupportedCheckoutError("A checkout that keeps its .git directory "
+            "cannot be hashed in-process.");
+    }
+}
+
+// Finds the first submodule in the tree, or returns an empty string if
+// there is none.
+static std::string findSubmodule(const GitTreeNode & node, const std::string & path)
+{
+    for (auto & nameAndChild : node.children)
+    {
+        const GitTreeNode & child = nameAndChild.second;
+        if (child.type != GitTreeNode::Directory) { continue; }
+        std::string childPath = path + nameAndChild.first;
+        if (child.submodule) { return childPath; }
+        std::string found = findSubmodule(child, childPath + "/");
+        if (!found.empty()) { return found; }
+    }
+    return "";
+}
+
+// Makes sure that the checkout that fetchgit would make of the tree has
+// the same files as the blobs, which is what the NAR is made from.
+static void checkCheckoutIsVerbatim(const std::string & git, const GitTreeNode & root,
+    const GitFetchArgs & args)
+{
+    if (args.fetchSubmodules)
+    {
+        std::string submodule = findSubmodule(root, "");
+        if (!submodule.empty())
+        {
+            throw UnsupportedCheckoutError("The submodule " + submodule +
+                " cannot be fetched in-process.");
+        }
+    }
+
+    std::vector<std::pair<std::string, std::string>> files;
+    collectAttributeFiles(root, "", files);
+    for (auto & pathAndBlob : files)
+    {
+        std::string attribute = findCheckoutAttribute(runShellCommand(git +
+            " cat-file blob " + shellQuote(pathAndBlob.second)));
+        if (!attribute.empty())
+        {
+            throw UnsupportedCheckoutError(pathAndBlob.first + " sets \"" +
+                attribute + "\", which changes files when they are checked out, "
+                "so they cannot be hashed in-process.");
+        }
+    }
+}
+
+static void writeNarBlob(const std::string & id, CatFileReader & blobs,
+    nix::Sink & sink)
+{
+    uint64_t size = blobs.readHeader(id);
+    nix::writeLongLong(size, sink);
+    blobs.copyContents(size, sink);
+    nix::writePadding(size, sink);
+}
+
+// Writes the NAR serialization of a node, the same way that nix's
+// dumpPath would write it for the checked-out files.
+static void writeNarNode(const GitTreeNode & node, CatFileReader & blobs,
+    nix::Sink & sink)
+{
+    nix::writeString("(", sink);
+    nix::writeString("type", sink);
+    if (node.type == GitTreeNode::Directory)
+    {
+        nix::writeString("directory", sink);
+        for (auto & nameAndChild : node.children)
+        {
+            nix::writeString("entry", sink);
+            nix::writeString("(", sink);
+            nix::writeString("name", sink);
+            nix::writeString(nameAndChild.first, sink);
+            nix::writeString("node", sink);
+            writeNarNode(nameAndChild.second, blobs, sink);
+            nix::writeString(")", sink);
+        }
+    }
+    else if (node.type == GitTreeNode::Symlink)
+    {
+        nix::writeString("symlink", sink);
+        nix::writeString("target", sink);
+        writeNarBlob(node.blob, blobs, sink);
+    }
+    else
+    {
+        nix::writeString("regular", sink);
+        if (node.type == GitTreeNode::Executable)
+        {
+            nix::writeString("executable", sink);
+            nix::writeString("", sink);
+        }
+        nix::writeString("contents", sink);
+        writeNarBlob(node.blob, blobs, sink);
+    }
+    nix::writeString(")", sink);
+}
+
+std::string hashGitCommit(const std::string & gitDir, const std::string & commit,
+    const GitFetchArgs & args)
+{
+    TraceScope trace("hashGitCommit", commit);
+    checkDotGitDropped(args);
+
+    std::string git = "git -C " + shellQuote(gitDir);
+
+    std::string listing = runShellCommand(git + " ls-tree -r -z --full-tree " +
+        shellQuote(commit));
+    GitTreeNode root = parseTreeListing(listing);
+    checkCheckoutIsVerbatim(git, root, args);
+
+    // Ask git for the blobs in NAR order so they can be streamed straight
+    // into the hash without holding them in memory.  The list goes in a
+    // private temporary directory rather than in gitDir, which might be
+    // someone's repository or be in use by another hash.
+    std::string blobList;
+    collectBlobs(root, blobList);
+    nix::Path tmpDir = nix::createTempDir("", "nix-update-git");
+    nix::AutoDelete deleteTmpDir(tmpDir, true);
+    nix::Path blobListPath = tmpDir + "/blobs";
+    nix::writeFile(blobListPath, blobList);
+
+    CatFileReader blobs(git + " cat-file --batch < " + shellQuote(blobListPath));
+    nix::HashSink sink(nix::htSHA256);
+    nix::writeString("nix-archive-1", sink);
+    writeNarNode(root, blobs, sink);
+    blobs.close();
+
+    return nix::printHash32(sink.finish().first);
+}
+
+GitRevisionInfo fetchGitRevision(const std::string & url,
+    const std::string & rev, const GitFetchArgs & args, bool quiet)
+{
+    TraceScope trace("fetchGitRevision", url);
+
+    // Refuse this before fetching anything, not after in hashGitCommit.
+    checkDotGitDropped(args);
+
+    nix::Path gitDir = nix::createTempDir("", "nix-update-git");
+    nix::AutoDelete autoDelete(gitDir, true);
+
+    std::string git = "git -C " + shellQuote(gitDir);
+    std::string redirect = quiet ? " 2>/dev/null" : "";
+
+    runShellCommand("git init --quiet --bare " + shellQuote(gitDir) + redirect);
+
+    // A shallow fetch transfers only the objects we need, but not every
+    // server allows fetching an arbitrary commit that way, so fall back
+    // to fetching all the branches and tags.
+    std::string fetch = git + " fetch --quiet " + shellQuote(url);
+    std::string commitish = "FETCH_HEAD";
+    try
+    {
+        runShellCommand(fetch + " --depth 1 " + shellQuote(rev) + redirect);
+    }
+    catch (const std::runtime_error &)
+    {
+        std::string refspecs = " '+refs/heads/*:refs/heads/*' '+refs/tags/*:refs/tags/*'";
+        if (rev == "HEAD") { refspecs = " HEAD" + refspecs; }
+        else { commitish = rev; }
+        runShellCommand(fetch + refspecs + redirect);
+    }
+
+    GitRevisionInfo info;
+    info.rev = chomp(runShellCommand(git + " rev-parse --verify " +
+        shellQuote(commitish + "^{commit}")));
+    info.sha256 = hashGitCommit(gitDir, info.rev, args);
+    return info;
+}
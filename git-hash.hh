@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+/** The result of fetching one revision of a git repository: the full
+ * commit id and the base-32 SHA-256 hash of its files, in the same form
+ * that nix-prefetch-git reports them. */
+struct GitRevisionInfo
+{
+    std::string rev;
+    std::string sha256;
+};
+
+/** The arguments of fetchgit, besides url, rev and sha256, that change
+ * which files end up in the store and so the hash.  The defaults are
+ * those of fetchgit in nixpkgs, where leaveDotGit defaults to the value
+ * of deepClone. */
+struct GitFetchArgs
+{
+    bool fetchSubmodules = true;
+    bool deepClone = false;
+    bool leaveDotGit = false;
+
+    bool operator < (const GitFetchArgs & other) const
+    {
+        return std::tie(fetchSubmodules, deepClone, leaveDotGit) <
+            std::tie(other.fetchSubmodules, other.deepClone, other.leaveDotGit);
+    }
+};
+
+/** Thrown when the files of a commit cannot be hashed straight from the
+ * git objects, because checking them out would give different files.
+ * This happens when a .gitattributes file in the tree asks git to
+ * convert line endings, expand $Id$, or run a filter such as Git LFS,
+ * when the tree has submodules that are to be fetched, and when the .git
+ * directory is to be kept.  nix-prefetch-git can still hash such
+ * commits. */
+class UnsupportedCheckoutError : public std::runtime_error
+{
+public:
+    explicit UnsupportedCheckoutError(const std::string & what)
+        : std::runtime_error(what)
+    {
+    }
+};
+
+/** Computes the hash that nix-prefetch-git would report for the given
+ * commit in the given git directory.  The NAR serialization is generated
+ * directly from the git objects, so nothing is checked out to disk.
+ * Throws UnsupportedCheckoutError if the checkout that fetchgit would
+ * make with the given arguments would not match the git objects. */
+std::string hashGitCommit(const std::string & gitDir, const std::string & commit,
+    const GitFetchArgs & args);
+
+/** Fetches a revision of a git repository into a temporary bare
+ * repository and hashes it with hashGitCommit.  The revision can be a
+ * commit id, a ref name, or "HEAD".  This does the same job as running
+ * nix-prefetch-git, but without the shell script, the checkout, or
+ * nix-hash, and throws UnsupportedCheckoutError for the same commits as
+ * hashGitCommit. */
+GitRevisionInfo fetchGitRevision(const std::string & url,
+    const std::string & rev, const GitFetchArgs & args, bool quiet);
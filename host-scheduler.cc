@@ -0,0 +1,296 @@
+#include "host-scheduler.hh"
+
+#include <algorithm>
+#include <exception>
+#include <ostream>
+
+std::string hostFromUrl(const std::string & url)
+{
+    std::string host;
+
+    size_t schemeEnd = url.find("://");
+    if (schemeEnd != std::string::npos)
+    {
+        if (url.compare(0, schemeEnd, "file") == 0) { return "localhost"; }
+
+        // The authority is "[user@]host[:port]".
+        size_t start = schemeEnd + 3;
+        std::string authority = url.substr(start, url.find('/', start) - start);
+        size_t at = authority.rfind('@');
+        if (at != std::string::npos) { authority = authority.substr(at + 1); }
+        if (!authority.empty() && authority[0] == '[')
+        {
+            // An IPv6 address.
+            host = authority.substr(1, authority.find(']') - 1);
+        }
+        else
+        {
+            host = authority.substr(0, authority.find(':'));
+        }
+    }
+    else
+    {
+        // The scp-like syntax has a colon before any slash.  Anything
+        // else is a local path.
+        size_t colon = url.find(':');
+        size_t slash = url.find('/');
+        if (colon == std::string::npos || (slash != std::string::npos && slash < colon))
+        {
+            return "localhost";
+        }
+        host = url.substr(0, colon);
+        size_t at = host.rfind('@');
+        if (at != std::string::npos) { host = host.substr(at + 1); }
+    }
+
+    std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+    if (host.empty()) { return "localhost"; }
+    return host;
+}
+
+HostScheduler::HostScheduler(unsigned int jobs, unsigned int perHostJobs,
+    double perHostRate)
+    : jobs(jobs), perHostJobs(perHostJobs), perHostRate(perHostRate)
+{
+    if (this->jobs == 0) { this->jobs = 1; }
+    bucketSize = perHostJobs > 1 ? perHostJobs : 1;
+}
+
+HostScheduler::~HostScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread & thread : threads)
+    {
+        thread.join();
+    }
+}
+
+// Finds the host that should start a job next.  Hosts that are at their
+// concurrency limit or out of tokens are skipped.  If a host is only
+// waiting for tokens, retryAt is set to when it will have one.
+HostScheduler::Host * HostScheduler::findRunnableHost(Clock::time_point now,
+    Clock::time_point & retryAt)
+{
+    Host * best = nullptr;
+    for (auto & nameAndHost : hosts)
+    {
+        Host & host = nameAndHost.second;
+        if (host.pending.empty()) { continue; }
+        if (perHostJobs != 0 && host.active >= perHostJobs) { continue; }
+
+        if (perHostRate > 0)
+        {
+            // Refill the token bucket.
+            double elapsed = std::chrono::duration<double>(now - host.lastRefill).count();
+            host.tokens = std::min(bucketSize, host.tokens + elapsed * perHostRate);
+            host.lastRefill = now;
+            if (host.tokens < 1)
+            {
+                auto wait = std::chrono::duration<double>((1 - host.tokens) / perHostRate);
+                Clock::time_point ready = now +
+                    std::chrono::duration_cast<Clock::duration>(wait);
+                if (retryAt == Clock::time_point() || ready < retryAt) { retryAt = ready; }
+                continue;
+            }
+        }
+
+        // Spread the threads across the hosts.
+        if (best == nullptr || host.active < best->active) { best = &host; }
+    }
+    return best;
+}
+
+void HostScheduler::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (1)
+    {
+        if (pendingCount == 0)
+        {
+            if (stopping) { return; }
+            changed.wait(lock);
+            continue;
+        }
+
+        Clock::time_point now = Clock::now();
+        Clock::time_point retryAt;
+        Host * host = findRunnableHost(now, retryAt);
+        if (host == nullptr)
+        {
+            // Wait for a job to finish or for a host to get a token.
+            if (retryAt == Clock::time_point()) { changed.wait(lock); }
+            else { changed.wait_until(lock, retryAt); }
+            continue;
+        }
+
+        Job job = std::move(host->pending.front());
+        host->pending.pop_front();
+        pendingCount--;
+        activeCount++;
+        host->active++;
+        if (perHostRate > 0) { host->tokens -= 1; }
+        if (host->started == 0) { host->firstStart = now; }
+        host->started++;
+        host->maxActive = std::max(host->maxActive, host->active);
+        host->waitSeconds += std::chrono::duration<double>(now - job.queued).count();
+        lock.unlock();
+
+        bool succeeded = true;
+        try
+        {
+            job.fun();
+        }
+        catch (...)
+        {
+            succeeded = false;
+        }
+
+        Clock::time_point finish = Clock::now();
+        lock.lock();
+        activeCount--;
+        host->active--;
+        if (!succeeded) { host->failed++; }
+        host->busySeconds += std::chrono::duration<double>(finish - now).count();
+        host->lastFinish = finish;
+        changed.notify_all();
+    }
+}
+
+void HostScheduler::submit(const std::string & hostName, std::function<void()> fun)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    enqueue(hostName, std::move(fun), nullptr);
+    changed.notify_all();
+}
+
+// Adds a job to the queue of its host.  The mutex must be locked.
+void HostScheduler::enqueue(const std::string & hostName,
+    std::function<void()> fun, const void * batch)
+{
+    Clock::time_point now = Clock::now();
+    auto it = hosts.find(hostName);
+    if (it == hosts.end())
+    {
+        // A new host starts with a full bucket.
+        Host & host = hosts[hostName];
+        host.tokens = bucketSize;
+        host.lastRefill = now;
+        it = hosts.find(hostName);
+    }
+
+    Job job;
+    job.fun = std::move(fun);
+    job.queued = now;
+    job.batch = batch;
+    it->second.pending.push_back(std::move(job));
+    pendingCount++;
+
+    if (threads.size() < jobs)
+    {
+        threads.push_back(std::thread([this]() { worker(); }));
+    }
+}
+
+// Moves the jobs of a batch that have not started out of the queues.  The
+// mutex must be locked.  The jobs are handed back so that the caller can
+// destroy them after unlocking, in case that has side effects.
+void HostScheduler::removePending(const void * batch, std::vector<Job> & removed)
+{
+    for (auto & nameAndHost : hosts)
+    {
+        std::deque<Job> & pending = nameAndHost.second.pending;
+        std::deque<Job> kept;
+        for (Job & job : pending)
+        {
+            if (job.batch == batch) { removed.push_back(std::move(job)); }
+            else { kept.push_back(std::move(job)); }
+        }
+        pending.swap(kept);
+    }
+}
+
+size_t HostScheduler::cancelPending()
+{
+    std::vector<Job> cancelled;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        removePending(nullptr, cancelled);
+        pendingCount -= cancelled.size();
+        changed.notify_all();
+    }
+    return cancelled.size();
+}
+
+void HostScheduler::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&]() { return pendingCount == 0 && activeCount == 0; });
+}
+
+void HostScheduler::run(const std::vector<std::string> & jobHosts,
+    const std::function<void(size_t)> & fun)
+{
+    // The jobs for this call, which finish or are dropped before it
+    // returns.  They are guarded by the scheduler's mutex.
+    size_t remaining = jobHosts.size();
+    std::exception_ptr firstError;
+    const void * batch = &remaining;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (size_t i = 0; i < jobHosts.size(); i++)
+    {
+        enqueue(jobHosts[i], [&, i]() {
+            std::exception_ptr error;
+            try
+            {
+                fun(i);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            std::vector<Job> dropped;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error && !firstError)
+                {
+                    firstError = error;
+                    removePending(batch, dropped);
+                    pendingCount -= dropped.size();
+                    remaining -= dropped.size();
+                }
+                remaining--;
+                changed.notify_all();
+            }
+            if (error) { std::rethrow_exception(error); }
+        }, batch);
+    }
+    changed.notify_all();
+
+    changed.wait(lock, [&]() { return remaining == 0; });
+    if (firstError) { std::rethrow_exception(firstError); }
+}
+
+void HostScheduler::printStats(std::ostream & stream) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto & nameAndHost : hosts)
+    {
+        const Host & host = nameAndHost.second;
+        if (host.started == 0) { continue; }
+        double span = std::chrono::duration<double>(
+            host.lastFinish - host.firstStart).count();
+        stream << "  " << nameAndHost.first << ": "
+               << host.started << " fetched";
+        if (host.failed) { stream << ", " << host.failed << " failed"; }
+        stream << ", " << host.busySeconds / host.started << " s each"
+               << ", " << host.waitSeconds / host.started << " s queued";
+        if (span > 0) { stream << ", " << host.started / span << " per second"; }
+        stream << ", up to " << host.maxActive << " at once" << std::endl;
+    }
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iosfwd>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** Gets the host name from a git URL, which can be "scheme://[user@]host
+ * [:port]/path" or the scp-like "[user@]host:path".  Local paths and
+ * file:// URLs all count as "localhost". */
+std::string hostFromUrl(const std::string & url);
+
+/** Runs jobs on a pool of threads, but limits how hard each host is
+ * hit: each host has its own limit on concurrent jobs and its own token
+ * bucket limiting how often jobs can start.  A host
+ * that is at its limit only holds back its own jobs; the threads move on
+ * to jobs for other hosts.  Statistics are kept for each host.
+ *
+ * All the public methods can be called from any thread.  The threads are
+ * started when jobs are first submitted and are kept until the scheduler
+ * is destroyed. */
+class HostScheduler
+{
+public:
+    /** A perHostJobs of 0 means no limit on concurrency.  A perHostRate
+     * of 0 means no limit on how many jobs start per second; otherwise
+     * the bucket holds at most max(1, perHostJobs) tokens. */
+    HostScheduler(unsigned int jobs, unsigned int perHostJobs, double perHostRate);
+
+    /** Finishes the jobs that have been submitted and stops the threads. */
+    ~HostScheduler();
+
+    HostScheduler(const HostScheduler &) = delete;
+    HostScheduler & operator = (const HostScheduler &) = delete;
+
+    /** Queues a job that talks to the given host and returns without
+     * waiting for it.  The job runs on one of the scheduler's threads.
+     * An exception thrown by the job is counted as a failure in the
+     * statistics and otherwise ignored, so the job should report its own
+     * errors. */
+    void submit(const std::string & host, std::function<void()> job);
+
+    /** Drops the submitted jobs that have not started yet, without
+     * running them, and returns how many there were.  Jobs queued by run
+     * are left alone, since run is waiting for them. */
+    size_t cancelPending();
+
+    /** Blocks until every job submitted so far has finished or been
+     * cancelled.  This must not be called from a job. */
+    void wait();
+
+    /** Calls fun(i) for each job i, where hosts[i] is the host that the
+     * job talks to, and blocks until they have all finished.  If any call
+     * throws, the jobs not yet started are dropped from the queues right
+     * away, without waiting for their hosts, and are left out of the
+     * statistics; the first exception is rethrown at the end.  This must
+     * not be called from a job. */
+    void run(const std::vector<std::string> & hosts,
+        const std::function<void(size_t)> & fun);
+
+    /** Prints the throughput of each host so far. */
+    void printStats(std::ostream & stream) const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // A job from submit has no batch; the jobs from one call to run
+    // share a batch, so they can be dropped together.
+    struct Job
+    {
+        std::function<void()> fun;
+        Clock::time_point queued;
+        const void * batch;
+    };
+
+    struct Host
+    {
+        std::deque<Job> pending;
+        unsigned int active = 0;
+        double tokens = 0;
+        Clock::time_point lastRefill;
+
+        // Statistics.
+        unsigned int started = 0;
+        unsigned int failed = 0;
+        unsigned int maxActive = 0;
+        double busySeconds = 0;
+        double waitSeconds = 0;
+        Clock::time_point firstStart, lastFinish;
+    };
+
+    void worker();
+    void enqueue(const std::string & hostName, std::function<void()> fun,
+        const void * batch);
+    void removePending(const void * batch, std::vector<Job> & removed);
+    Host * findRunnableHost(Clock::time_point now, Clock::time_point & retryAt);
+
+    unsigned int jobs;
+    unsigned int perHostJobs;
+    double perHostRate;
+    double bucketSize;
+
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    std::map<std::string, Host> hosts;
+    std::vector<std::thread> threads;
+    size_t pendingCount = 0;
+    size_t activeCount = 0;
+    bool stopping = false;
+};
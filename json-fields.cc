@@ -0,0 +1,272 @@
+#include "json-fields.hh"
+#include "trace.hh"
+
+#include <cstring>
+#include <stdexcept>
+
+static void throwMalformed()
+{
+    throw std::runtime_error("Malformed JSON.");
+}
+
+namespace
+{
+    class JsonScanner
+    {
+        const char * p;
+        const char * end;
+
+    public:
+        JsonScanner(const char * begin, const char * end) : p(begin), end(end) { }
+
+        bool atEnd()
+        {
+            skipWhitespace();
+            return p == end;
+        }
+
+        void skipWhitespace()
+        {
+            while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            {
+                p++;
+            }
+        }
+
+        // Skips whitespace and then consumes the given character if it
+        // is next.
+        bool accept(char c)
+        {
+            skipWhitespace();
+            if (p == end || *p != c) { return false; }
+            p++;
+            return true;
+        }
+
+        void expect(char c)
+        {
+            if (!accept(c)) { throwMalformed(); }
+        }
+
+        bool peek(char c)
+        {
+            skipWhitespace();
+            return p != end && *p == c;
+        }
+
+        // Consumes a string and reports where its raw contents are.
+        void string(const char * & begin, const char * & stringEnd, bool & escaped)
+        {
+            expect('"');
+            begin = p;
+            escaped = false;
+            while (1)
+            {
+                if (p == end) { throwMalformed(); }
+                if (*p == '"') { break; }
+                if (*p == '\\')
+                {
+                    escaped = true;
+                    p++;
+                    if (p == end) { throwMalformed(); }
+                }
+                p++;
+            }
+            stringEnd = p;
+            p++;
+        }
+
+        // Consumes any value without looking at it.
+        void skipValue()
+        {
+            const char * begin, * stringEnd;
+            bool escaped;
+
+            skipWhitespace();
+            if (p == end) { throwMalformed(); }
+
+            if (*p == '"')
+            {
+                string(begin, stringEnd, escaped);
+            }
+            else if (*p == '{')
+            {
+                p++;
+                if (accept('}')) { return; }
+                do
+                {
+                    string(begin, stringEnd, escaped);
+                    expect(':');
+                    skipValue();
+                } while (accept(','));
+                expect('}');
+            }
+            else if (*p == '[')
+            {
+                p++;
+                if (accept(']')) { return; }
+                do
+                {
+                    skipValue();
+                } while (accept(','));
+                expect(']');
+            }
+            else
+            {
+                // A number, true, false, or null.
+                const char * start = p;
+                while (p != end && *p != ',' && *p != '}' && *p != ']' &&
+                    *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+                {
+                    p++;
+                }
+                if (p == start) { throwMalformed(); }
+            }
+        }
+    };
+}
+
+void extractJsonStringFields(const std::string & json,
+    JsonStringField * fields, size_t fieldCount)
+{
+    TraceScope trace("extractJsonStringFields");
+
+    JsonScanner scanner(json.data(), json.data() + json.size());
+
+    scanner.expect('{');
+    if (!scanner.accept('}'))
+    {
+        do
+        {
+            const char * keyBegin, * keyEnd;
+            bool keyEscaped;
+            scanner.string(keyBegin, keyEnd, keyEscaped);
+            scanner.expect(':');
+
+            // Keys with escape sequences in them are never requested,
+            // so the raw key can be compared directly.
+            JsonStringField * field = nullptr;
+            size_t keyLength = keyEnd - keyBegin;
+            for (size_t i = 0; i < fieldCount; i++)
+            {
+                if (strlen(fields[i].key) == keyLength &&
+                    memcmp(fields[i].key, keyBegin, keyLength) == 0)
+                {
+                    field = &fields[i];
+                    break;
+                }
+            }
+
+            if (field == nullptr)
+            {
+                scanner.skipValue();
+                continue;
+            }
+
+            if (!scanner.peek('"'))
+            {
+                throw std::runtime_error(std::string("JSON key '") + field->key +
+                    "' does not have a string value.");
+            }
+            scanner.string(field->begin, field->end, field->escaped);
+            field->found = true;
+        } while (scanner.accept(','));
+        scanner.expect('}');
+    }
+
+    if (!scanner.atEnd()) { throwMalformed(); }
+}
+
+// Appends a Unicode code point to a string in UTF-8.
+static void appendUtf8(std::string & str, unsigned long c)
+{
+    if (c < 0x80)
+    {
+        str += (char)c;
+    }
+    else if (c < 0x800)
+    {
+        str += (char)(0xC0 | (c >> 6));
+        str += (char)(0x80 | (c & 0x3F));
+    }
+    else if (c < 0x10000)
+    {
+        str += (char)(0xE0 | (c >> 12));
+        str += (char)(0x80 | ((c >> 6) & 0x3F));
+        str += (char)(0x80 | (c & 0x3F));
+    }
+    else
+    {
+        str += (char)(0xF0 | (c >> 18));
+        str += (char)(0x80 | ((c >> 12) & 0x3F));
+        str += (char)(0x80 | ((c >> 6) & 0x3F));
+        str += (char)(0x80 | (c & 0x3F));
+    }
+}
+
+// Reads the four hex digits of a \u escape sequence.
+static unsigned long readHex4(const char * & p, const char * end)
+{
+    if (end - p < 4) { throwMalformed(); }
+    unsigned long c = 0;
+    for (int i = 0; i < 4; i++, p++)
+    {
+        c <<= 4;
+        if (*p >= '0' && *p <= '9') { c |= *p - '0'; }
+        else if (*p >= 'a' && *p <= 'f') { c |= *p - 'a' + 10; }
+        else if (*p >= 'A' && *p <= 'F') { c |= *p - 'A' + 10; }
+        else { throwMalformed(); }
+    }
+    return c;
+}
+
+std::string JsonStringField::value() const
+{
+    if (!escaped) { return std::string(begin, end); }
+
+    std::string result;
+    result.reserve(end - begin);
+    const char * p = begin;
+    while (p != end)
+    {
+        if (*p != '\\')
+        {
+            result += *p++;
+            continue;
+        }
+
+        p++;
+        char c = *p++;
+        switch (c)
+        {
+        case 'b': result += '\b'; break;
+        case 'f': result += '\f'; break;
+        case 'n': result += '\n'; break;
+        case 'r': result += '\r'; break;
+        case 't': result += '\t'; break;
+        case 'u':
+            {
+                unsigned long code = readHex4(p, end);
+                if (code >= 0xD800 && code < 0xDC00 &&
+                    end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+                {
+                    // A surrogate pair.
+                    p += 2;
+                    unsigned long low = readHex4(p, end);
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUtf8(result, code);
+            }
+            break;
+        default: result += c; break;
+        }
+    }
+    return result;
+}
+
+bool JsonStringField::equals(const std::string & str) const
+{
+    if (escaped) { return value() == str; }
+    return str.size() == (size_t)(end - begin) &&
+        memcmp(str.data(), begin, str.size()) == 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+
+/** A top-level key of a JSON object whose string value we want.  After
+ * extraction, begin and end point at the raw contents of the string,
+ * between the quotes and still escaped, inside the original buffer. */
+struct JsonStringField
+{
+    const char * key;
+    bool found = false;
+    bool escaped = false;
+    const char * begin = nullptr;
+    const char * end = nullptr;
+
+    JsonStringField(const char * key) : key(key) { }
+
+    /** Returns the value with its escape sequences decoded. */
+    std::string value() const;
+
+    /** Compares the decoded value to the given string.  This only
+     * allocates if the value has escape sequences in it. */
+    bool equals(const std::string & str) const;
+};
+
+/** Extracts string values from a JSON object in a single pass over the
+ * buffer, without building a nix::Value or allocating memory.  Keys that
+ * were not requested are skipped, along with their values.  Throws an
+ * exception if the JSON is malformed or one of the requested keys has a
+ * value that is not a string.  Unlike nix's parseJSON, this does not
+ * need an EvalState, so it can be called from any thread. */
+void extractJsonStringFields(const std::string & json,
+    JsonStringField * fields, size_t fieldCount);
@@ -1,17 +1,20 @@
 #include "libupdate.hh"
+#include "locked-file.hh"
+#include "string-literal.hh"
+#include "trace.hh"
 
+#include <hash.hh>
 #include <parser-tab.hh>
 
 #include <stdio.h>
-#include <sstream>
-#include <fstream>
+#include <algorithm>
 #include <system_error>
 #include <cassert>
 
 std::ostream & operator << (std::ostream & str, const ExprStringAndPos & v)
 {
     str << "string at " << v.pos << ':' << std::endl;
-    str << "  " << v.c_str() << std::endl;
+    str << "  " << v.value << std::endl;
     return str;
 }
 
@@ -36,69 +39,43 @@ nix::ExprApp * tryInterpretAsApp(nix::Expr * expr, const std::string & name)
     return app;
 }
 
-// Checks the given function application for a string attribute with the given name.
-// The attribute value must be a single non-idented literal string.
-// Returns information about the string attribute as a ExprStringAndPos object.
-// Returns true if successful.
-std::pair<ExprStringAndPos, bool> findStringFromApp(
-    const nix::ExprApp * app,
-    const std::string & name)
+bool tryGetLiteralString(const nix::Expr * expr, std::string & value)
 {
-    std::pair<ExprStringAndPos, bool> result;
-
-    nix::ExprAttrs * attrs = dynamic_cast<nix::ExprAttrs *>(app->e2);
-    if (attrs == nullptr) { return result; }
-
-    for (auto & symbolAndAttr : attrs->attrs)
+    auto * es = dynamic_cast<const nix::ExprString *>(expr);
+    if (es != nullptr)
     {
-        // Continue looping if this attribute has the wrong name.
-        if (name != (const std::string &)symbolAndAttr.first) { continue; }
-
-        // Continue looping if this attribute's value is not a single non-indented string.
-        auto * es = dynamic_cast<const nix::ExprString *>(symbolAndAttr.second.e);
-        if (es == nullptr) { continue; }
-        if (es->v.type != nix::ValueType::tString) { continue; }
-
-        // nix::ExprString does not know its position.  To get the
-        // position of tee string, we assume that the string starts on
-        // the same line as the attribute definition and there is
-        // exactly one space on each side of the equal sign.
-        nix::Pos pos = symbolAndAttr.second.pos;
-        pos.column += name.length() + 3;
-
-        result.first.expr = es;
-        result.first.pos = pos;
-        result.second = true;
-        return result;
+        if (es->v.type != nix::ValueType::tString) { return false; }
+        value = es->v.string.s;
+        return true;
     }
 
-    return result;
-}
-
-std::pair<std::string, bool> findStringFromBindings(nix::Bindings & bindings,
-    const std::string & name)
-{
-    std::pair<std::string, bool> result;
-
-    for (size_t i = 0; i < bindings.size(); i++)
+    // The parser normally turns indented strings into ExprString, but
+    // accept them in case one is left over.
+    auto * eis = dynamic_cast<const nix::ExprIndStr *>(expr);
+    if (eis != nullptr)
     {
-        nix::Attr & attr = bindings[i];
-
-        // Continue looping if this attribute has the wrong name.
-        if (name != (const std::string &)attr.name) { continue; }
+        value = eis->s;
+        return true;
+    }
 
-        // Make sure this attribute's value is a string.
-        if (attr.value->type != nix::ValueType::tString)
+    // Strings with antiquotations, and indented strings with escape
+    // sequences, become concatenations.  We can handle them if every
+    // part is a literal.
+    auto * ecs = dynamic_cast<const nix::ExprConcatStrings *>(expr);
+    if (ecs != nullptr && ecs->forceString && ecs->es != nullptr)
+    {
+        std::string result;
+        for (const nix::Expr * part : *ecs->es)
         {
-            throw std::runtime_error("expected a string, got something else");
+            std::string partValue;
+            if (!tryGetLiteralString(part, partValue)) { return false; }
+            result += partValue;
         }
-
-        result.first = std::string(attr.value->string.s);
-        result.second = true;
-        return result;
+        value = result;
+        return true;
     }
 
-    return result;
+    return false;
 }
 
 /** Runs a shell command using popen.  The command's standard output is
@@ -106,6 +83,9 @@ std::pair<std::string, bool> findStringFromBindings(nix::Bindings & bindings,
  * process.  Errors are converted into exceptions. */
 std::string runShellCommand(const std::string & cmd)
 {
+    TraceScope trace("runShellCommand", cmd, counterSubprocessMicroseconds);
+    traceCount(counterSubprocesses);
+
     FILE * fp = popen(cmd.c_str(), "r");
     if (fp == nullptr)
     {
@@ -114,10 +94,16 @@ std::string runShellCommand(const std::string & cmd)
         throw std::system_error(ev, std::system_category(), what);
     }
 
+    // Read with fread instead of fgets so that binary output, such as
+    // the NUL-separated output of "git ls-tree -z", is preserved.
     std::string output;
     while (1)
     {
-        if (feof(fp)) { break; }
+        char buffer[4096];
+        size_t count = fread(buffer, 1, sizeof(buffer), fp);
+        output.append(buffer, count);
+        traceCount(counterBytesRead, count);
+        if (count == sizeof(buffer)) { continue; }
 
         if (ferror(fp))
         {
@@ -125,12 +111,7 @@ std::string runShellCommand(const std::string & cmd)
             std::string what = "Failed to read from pipe";
             throw std::runtime_error(what);
         }
-
-        char buffer[128];
-        if (fgets(buffer, sizeof(buffer), fp) != nullptr)
-        {
-            output.append(buffer);
-        }
+        break;
     }
 
     int ret = pclose(fp);
@@ -153,102 +134,246 @@ std::string runShellCommand(const std::string & cmd)
     return output;
 }
 
-#include <iostream>
+namespace
+{
+    // A replacement of an exact range of bytes.
+    struct ByteRangeReplacement
+    {
+        size_t begin, end;
+        StringRef newText;
+    };
+}
 
-// Note: This will add a blank line to the last line.
-// Note: I am not sure what would happen in Windows with \r\n line endings.
-static void performReplacementsCore(
-    const std::vector<StringReplacement> & sortedReplacements,
-    std::istream & input, std::ostream & output)
+// Finds the offset of the start of each line.
+static std::vector<size_t> findLineStarts(const std::string & contents)
 {
-    auto ri = sortedReplacements.begin();
-    size_t lineNumber = 0;
+    std::vector<size_t> lineStarts;
+    lineStarts.push_back(0);
+    for (size_t i = 0; i < contents.size(); i++)
+    {
+        if (contents[i] == '\n') { lineStarts.push_back(i + 1); }
+    }
+    return lineStarts;
+}
 
-    while (1)
+// Finds the string literal that a replacement applies to and decodes its
+// current value.
+static LiteralRange findReplacementLiteral(const std::string & contents,
+    const std::vector<size_t> & lineStarts, const StringReplacement & sr,
+    std::string & value)
+{
+    if (sr.line == 0 || sr.line > lineStarts.size() || sr.column == 0)
     {
-        // Read a line from the input.
-        lineNumber++;
-        std::string line;
-        std::getline(input, line);
-        if (input.fail())
-        {
-            if (input.eof())
-            {
-                break;
-            }
-            throw std::runtime_error("Failed to read line.");
-        }
+        throw std::runtime_error("File has fewer lines than expected.");
+    }
+    size_t offset = lineStarts[sr.line - 1] + sr.column - 1;
+    if (offset > contents.size())
+    {
+        throw std::runtime_error("File contents mismatch.");
+    }
+    LiteralRange literal = findAttrValueLiteral(contents, offset);
+    if (!decodeStringLiteral(contents, literal, value))
+    {
+        throw std::runtime_error("File contents mismatch.");
+    }
+    return literal;
+}
 
-        // Apply all the replacements needed on this line.
-        while (ri != sortedReplacements.end() &&
-            ri->line == lineNumber)
-        {
-            // Make sure that the current contents of the line match what we expect.
-            if (line.substr(ri->column - 1, ri->oldString.size()) != ri->oldString)
-            {
-                throw std::runtime_error("File contents mismatch.");
-            }
+static bool valueEquals(const std::string & value, StringRef ref)
+{
+    return value.size() == ref.size &&
+        value.compare(0, value.size(), ref.data, ref.size) == 0;
+}
 
-            // Perform the replacement.
-            line.replace(ri->column - 1, ri->oldString.size(), ri->newString);
+std::string applyReplacements(const std::string & contents,
+    const std::vector<StringReplacement> & replacements)
+{
+    // Find the literal that each replacement applies to.
+    std::vector<size_t> lineStarts = findLineStarts(contents);
+    std::vector<ByteRangeReplacement> ranges;
+    ranges.reserve(replacements.size());
+    for (const StringReplacement & sr : replacements)
+    {
+        std::string value;
+        LiteralRange literal = findReplacementLiteral(contents, lineStarts, sr, value);
 
-            // Advance to the next replacement in the sorted list.
-            ++ri;
+        // Make sure that the current contents of the file match what we expect.
+        if (!valueEquals(value, sr.oldValue))
+        {
+            throw std::runtime_error("File contents mismatch.");
         }
 
-        // Write the modified line to the output.
-        output << line << std::endl;
-        if (output.fail())
+        ByteRangeReplacement range;
+        range.begin = literal.begin;
+        range.end = literal.end;
+        range.newText = sr.newString;
+        ranges.push_back(range);
+    }
+
+    // Sort the ranges by position and make sure they do not overlap.
+    // Several call sites can share one literal, such as a let-bound rev,
+    // so identical replacements are merged.
+    std::sort(ranges.begin(), ranges.end(),
+        [](const ByteRangeReplacement & a, const ByteRangeReplacement & b) {
+            return a.begin < b.begin;
+    });
+    ranges.erase(std::unique(ranges.begin(), ranges.end(),
+        [](const ByteRangeReplacement & a, const ByteRangeReplacement & b) {
+            return a.begin == b.begin && a.end == b.end && a.newText == b.newText;
+    }), ranges.end());
+    for (size_t i = 1; i < ranges.size(); i++)
+    {
+        if (ranges[i].begin < ranges[i - 1].end)
         {
-            throw std::runtime_error("Failed to write line.");
+            throw std::runtime_error("Overlapping replacements.");
         }
     }
 
-    if (ri != sortedReplacements.end())
+    // Copy the file, splicing in the new text.
+    size_t newSize = contents.size();
+    for (const ByteRangeReplacement & range : ranges)
     {
-        throw std::runtime_error("File has fewer lines than expected.");
+        newSize += range.newText.size;
+        newSize -= range.end - range.begin;
+    }
+    std::string result;
+    result.reserve(newSize);
+    size_t copied = 0;
+    for (const ByteRangeReplacement & range : ranges)
+    {
+        result.append(contents, copied, range.begin - copied);
+        result.append(range.newText.data, range.newText.size);
+        copied = range.end;
     }
+    result.append(contents, copied, std::string::npos);
+    return result;
 }
 
-void performReplacements(const std::string & path,
+std::vector<LiteralRange> findReplacementLiterals(const std::string & contents,
     const std::vector<StringReplacement> & replacements)
 {
-    // Sort the replacements by line number.
-    std::vector<StringReplacement> sortedReplacements = replacements;
-    std::sort (sortedReplacements.begin(), sortedReplacements.end(),
-        [](const StringReplacement & a, const StringReplacement & b) {
-            if (a.line == b.line) { return a.column > b.column; }
-            return a.line < b.line;
-    });
-
-    std::string modifiedFile;
+    std::vector<size_t> lineStarts = findLineStarts(contents);
+    std::vector<LiteralRange> literals;
+    literals.reserve(replacements.size());
+    for (const StringReplacement & sr : replacements)
+    {
+        std::string value;
+        literals.push_back(findReplacementLiteral(contents, lineStarts, sr, value));
+    }
+    return literals;
+}
 
+std::vector<size_t> findFailingReplacements(const std::string & contents,
+    const std::vector<StringReplacement> & replacements)
+{
+    std::vector<size_t> lineStarts = findLineStarts(contents);
+    std::vector<size_t> failing;
+    for (size_t i = 0; i < replacements.size(); i++)
     {
-        std::ifstream inputStream(path);
-        if (inputStream.fail())
+        std::string value;
+        try
         {
-            int ev = errno;
-            std::string what = std::string("Failed to open file for input: ") + path;
-            throw std::system_error(ev, std::system_category(), what);
+            findReplacementLiteral(contents, lineStarts, replacements[i], value);
         }
-        std::ostringstream stringStream;
-        performReplacementsCore(sortedReplacements, inputStream, stringStream);
-        modifiedFile = stringStream.str();
+        catch (const std::runtime_error &)
+        {
+            failing.push_back(i);
+            continue;
+        }
+        if (!valueEquals(value, replacements[i].oldValue)) { failing.push_back(i); }
+    }
+    return failing;
+}
+
+std::string hashContents(const std::string & contents)
+{
+    return nix::printHash(nix::hashString(nix::htSHA256, contents));
+}
+
+void performReplacements(const std::string & path,
+    const std::vector<StringReplacement> & replacements)
+{
+    TraceScope trace("performReplacements", path);
+    LockedFile file(path, true);
+    file.write(applyReplacements(file.read(), replacements));
+}
+
+// Checks whether a replacement planned for older contents of a file still
+// fits the current contents.  Another runner might have already made the
+// same change, in which case it is no longer needed.
+static bool replacementConflicts(const std::string & contents,
+    const std::vector<size_t> & lineStarts, const StringReplacement & sr,
+    bool & needed)
+{
+    std::string value;
+    try
+    {
+        findReplacementLiteral(contents, lineStarts, sr, value);
+    }
+    catch (const std::runtime_error &)
+    {
+        return true;
     }
 
+    needed = true;
+    if (valueEquals(value, sr.oldValue)) { return false; }
+
+    std::string newString = sr.newString.str();
+    LiteralRange newLiteral;
+    newLiteral.begin = 0;
+    newLiteral.end = newString.size();
+    std::string newValue;
+    if (decodeStringLiteral(newString, newLiteral, newValue) && newValue == value)
     {
-        std::ofstream outputStream(path);
-        if (outputStream.fail())
+        needed = false;
+        return false;
+    }
+    return true;
+}
+
+size_t performReplacements(const std::string & path,
+    const std::string & expectedHash,
+    const std::vector<StringReplacement> & replacements,
+    const ReplanFunction & replan)
+{
+    TraceScope trace("performReplacements", path);
+    LockedFile file(path, true);
+    std::string contents = file.read();
+
+    if (hashContents(contents) == expectedHash)
+    {
+        file.write(applyReplacements(contents, replacements));
+        return 0;
+    }
+
+    // Another process changed the file after the replacements were
+    // planned.  Keep the ones that still fit and re-plan the others.
+    std::vector<size_t> lineStarts = findLineStarts(contents);
+    std::vector<StringReplacement> kept;
+    std::vector<size_t> conflicts;
+    for (size_t i = 0; i < replacements.size(); i++)
+    {
+        bool needed = false;
+        if (replacementConflicts(contents, lineStarts, replacements[i], needed))
         {
-            int ev = errno;
-            std::string what = std::string("Failed to open file for writing: ") + path;
-            throw std::system_error(ev, std::system_category(), what);
+            conflicts.push_back(i);
         }
-        outputStream << modifiedFile;
-        if (outputStream.fail())
+        else if (needed)
         {
-            throw std::runtime_error("Failed to write to file.");
+            kept.push_back(replacements[i]);
         }
     }
-}
 
+    if (!conflicts.empty())
+    {
+        TraceScope trace("replan", path);
+        std::vector<StringReplacement> replanned = replan(contents, conflicts);
+        kept.insert(kept.end(), replanned.begin(), replanned.end());
+    }
+
+    if (!kept.empty())
+    {
+        file.write(applyReplacements(contents, kept));
+    }
+    return conflicts.size();
+}
@@ -1,62 +1,106 @@
 #pragma once
 
+#include "string-literal.hh"
+#include "string-pool.hh"
+
 #include <nixexpr.hh>
 
+#include <functional>
 #include <string>
 #include <vector>
 
+/** A change to make to a file: the string literal assigned to the
+ * attribute defined at the given line and column is expected to have the
+ * value oldValue, and is to be replaced with the text newString, which
+ * includes the quotes.  The literal may span several lines.  The strings
+ * usually point into the StringPool for the run, so these are cheap to
+ * copy. */
 struct StringReplacement
 {
     uint32_t line, column;
-    std::string oldString;
-    std::string newString;
+    StringRef oldValue;
+    StringRef newString;
 };
 
-/** Stores information about a parsed string literal: its ExprString
- * object and its position in this file.  */
+/** Stores information about a parsed string literal: its expression, its
+ * value, and the position of the attribute definition it belongs to.
+ * nix does not record the positions of strings themselves, so the
+ * literal is found later by reading the file from that position. */
 struct ExprStringAndPos
 {
-    const nix::ExprString * expr = nullptr;
+    const nix::Expr * expr = nullptr;
+
+    std::string value;
 
     nix::Pos pos;
 
     const char * c_str() const
     {
-        if (expr == nullptr) { return ""; }
-        if (expr->v.type != nix::ValueType::tString) { return ""; }
-        return expr->v.string.s;
+        return value.c_str();
     }
 
     std::string string() const
     {
-        return c_str();
+        return value;
     }
-
-    StringReplacement replacement(const std::string & newString) const
-    {
-        StringReplacement sr;
-        sr.line = pos.line;
-        sr.column = pos.column;
-        std::string quote("\"");
-        sr.oldString = quote + string() + quote;
-        sr.newString = quote + newString + quote;
-        return sr;
-    }
-
 };
 
 std::ostream & operator << (std::ostream & str, const ExprStringAndPos & v);
 
+/** Gets the value of an expression that is a string made only of
+ * literals: a simple or indented string, or a concatenation of them.
+ * Returns false for anything else. */
+bool tryGetLiteralString(const nix::Expr * expr, std::string & value);
+
 nix::ExprApp * tryInterpretAsApp(nix::Expr * expr, const std::string & name);
 
-std::pair<ExprStringAndPos, bool> findStringFromApp(
-    const nix::ExprApp * app,
-    const std::string & name);
+std::string runShellCommand(const std::string & cmd);
 
-std::pair<std::string, bool> findStringFromBindings(nix::Bindings & bindings,
-    const std::string & name);
+/** Applies the replacements to the contents of a .nix file and returns
+ * the result.  Throws an exception if any literal does not have the value
+ * the replacement expects, or if two replacements overlap. */
+std::string applyReplacements(const std::string & contents,
+    const std::vector<StringReplacement> & replacements);
 
-std::string runShellCommand(const std::string & cmd);
+/** Finds the string literal that each replacement applies to in the
+ * contents of a .nix file, without checking its value. */
+std::vector<LiteralRange> findReplacementLiterals(const std::string & contents,
+    const std::vector<StringReplacement> & replacements);
+
+/** Checks that applyReplacements would find the literal of each
+ * replacement in the contents of a .nix file, with the value that the
+ * replacement expects.  Returns the indices of the replacements for
+ * which it would throw. */
+std::vector<size_t> findFailingReplacements(const std::string & contents,
+    const std::vector<StringReplacement> & replacements);
 
+/** Gets a hash of the contents of a file, for checking later whether the
+ * file has changed. */
+std::string hashContents(const std::string & contents);
+
+/** Applies the replacements to a file while holding an exclusive lock on
+ * it (see LockedFile).  Throws like applyReplacements if the file does
+ * not have the expected contents. */
 void performReplacements(const std::string & path,
     const std::vector<StringReplacement> &);
+
+/** Called when a file has changed since its replacements were planned,
+ * with the current contents of the file and the indices of the
+ * replacements that no longer fit them.  Returns the replacements to make
+ * instead.  The file stays locked while this runs. */
+typedef std::function<std::vector<StringReplacement>(const std::string & contents,
+    const std::vector<size_t> & conflicts)> ReplanFunction;
+
+/** Applies the replacements to a file with compare-and-swap semantics, so
+ * that several runners can update the same file without losing each
+ * other's changes.  expectedHash is the hashContents of the contents the
+ * replacements were planned for.  The file is locked while it is read
+ * and rewritten.  If its hash no longer matches, each replacement is
+ * checked against the current contents: it is kept if its literal still
+ * has the old value, dropped if the literal already has the new value,
+ * and otherwise passed to replan.  Returns the number of replacements
+ * that were re-planned. */
+size_t performReplacements(const std::string & path,
+    const std::string & expectedHash,
+    const std::vector<StringReplacement> & replacements,
+    const ReplanFunction & replan);
@@ -0,0 +1,81 @@
+#include "locked-file.hh"
+#include "trace.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <system_error>
+
+static void throwSystemError(const std::string & what)
+{
+    int ev = errno;
+    throw std::system_error(ev, std::system_category(), what);
+}
+
+LockedFile::LockedFile(const std::string & path, bool exclusive) : path(path)
+{
+    fd = open(path.c_str(), (exclusive ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd == -1)
+    {
+        throwSystemError(std::string("Failed to open file: ") + path);
+    }
+
+    TraceScope trace("lockFile", path);
+    while (flock(fd, exclusive ? LOCK_EX : LOCK_SH) == -1)
+    {
+        if (errno == EINTR) { continue; }
+        int ev = errno;
+        close(fd);
+        throw std::system_error(ev, std::system_category(),
+            std::string("Failed to lock file: ") + path);
+    }
+}
+
+LockedFile::~LockedFile()
+{
+    // Closing the file releases the lock.
+    close(fd);
+}
+
+std::string LockedFile::read()
+{
+    std::string contents;
+    char buffer[65536];
+    off_t offset = 0;
+    while (1)
+    {
+        ssize_t count = pread(fd, buffer, sizeof(buffer), offset);
+        if (count == -1)
+        {
+            if (errno == EINTR) { continue; }
+            throwSystemError(std::string("Failed to read file: ") + path);
+        }
+        if (count == 0) { break; }
+        contents.append(buffer, count);
+        offset += count;
+    }
+    traceCount(counterBytesRead, contents.size());
+    return contents;
+}
+
+void LockedFile::write(const std::string & contents)
+{
+    size_t written = 0;
+    while (written < contents.size())
+    {
+        ssize_t count = pwrite(fd, contents.data() + written,
+            contents.size() - written, written);
+        if (count == -1)
+        {
+            if (errno == EINTR) { continue; }
+            throwSystemError(std::string("Failed to write to file: ") + path);
+        }
+        written += count;
+    }
+    if (ftruncate(fd, contents.size()) == -1)
+    {
+        throwSystemError(std::string("Failed to write to file: ") + path);
+    }
+    traceCount(counterBytesWritten, contents.size());
+}
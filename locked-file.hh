@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+/** A file that is open while holding an advisory lock on it, taken with
+ * flock(2).  The lock is released when the object is destroyed.  Only
+ * processes that also lock the file are held back by it.
+ *
+ * flock is used rather than fcntl locks because an fcntl lock is dropped
+ * as soon as the process closes any descriptor for the file, which
+ * happens whenever nix parses it. */
+class LockedFile
+{
+public:
+    /** Opens the file and waits for the lock.  An exclusive lock opens
+     * the file for writing as well as reading. */
+    LockedFile(const std::string & path, bool exclusive);
+    ~LockedFile();
+
+    LockedFile(const LockedFile &) = delete;
+    LockedFile & operator = (const LockedFile &) = delete;
+
+    /** Reads the whole file. */
+    std::string read();
+
+    /** Replaces the contents of the file.  The file is rewritten in place
+     * rather than replaced by a new one, because other processes wait
+     * for the lock on this inode.  Requires an exclusive lock. */
+    void write(const std::string & contents);
+
+private:
+    std::string path;
+    int fd;
+};
@@ -1,114 +1,206 @@
 #include "standard.hh"
 
-// TODO: add support for --deepClone and other options to fetchGit/nix-prefetch-git
-
 const char * help =
     "Usage: nix-update-git [OPTION]... NIXFILE\n"
     "Updates calls to fetchgit in the NIXFILE to fetch latest upstream version.\n"
     "\n"
     "Options:\n"
-    "  -h, --help    Show this help screen\n"
-    // TODO: "  --version     Show version number\n"
-    "  -q, --quiet   Suppress non-error output\n";
+    "  -h, --help          Show this help screen\n"
+    // TODO: "  --version           Show version number\n"
+    "  -q, --quiet         Suppress non-error output\n"
+    "  -j, --jobs N        Fetch up to N repositories at once\n"
+    "  --per-host-jobs N   Fetch up to N repositories at once from each host\n"
+    "  --per-host-rate R   Start at most R fetches per second on each host\n"
+    "  --in-process        Hash repositories in-process instead of running\n"
+    "                      nix-prefetch-git\n"
+    "  --verify            Check the existing hashes by fetching each call\n"
+    "                      site at its current rev, without modifying NIXFILE\n"
+    "  --compare-hashers   Check that the in-process hashes match\n"
+    "                      nix-prefetch-git, without modifying NIXFILE\n"
+    "  --trace=FILE        Write timing information to FILE in the Chrome\n"
+    "                      trace-event format\n";
 
 struct NixUpdateGitOptions
 {
     bool showHelp = false;
     bool showVersion = false;
-    bool quiet = false;
+    bool compareHashers = false;
+    bool verify = false;
+    FetchGitOptions fetch;
+    std::string tracePath;
     std::string path;
 };
 
-struct FetchGitApp
-{
-    const nix::ExprApp * app;
-    ExprStringAndPos urlString, revString, hashString;
-    std::string newRev;
-    std::string newHash;
-};
-
-std::pair<FetchGitApp, bool> tryInterpretAsFetchGitApp(nix::Expr * expr)
+// Fetches every repository with nix-prefetch-git and then checks that the
+// in-process hasher computes the same hash for the same revision.  Commits
+// that the in-process hasher refuses to hash are reported, but are not
+// counted as mismatches.
+int compareHashers(const std::vector<FetchGitApp> & fetchGitApps,
+    StringPool & pool, const NixUpdateGitOptions & options)
 {
-    std::pair<FetchGitApp, bool> result;
-    FetchGitApp & fga = result.first;
-
-    fga.app = tryInterpretAsApp(expr, "fetchgit");
-    if (fga.app == nullptr) { return result; }
+    const FetchGitOptions & fetch = options.fetch;
+    HostScheduler scheduler(fetch.jobs, fetch.perHostJobs, fetch.perHostRate);
+    std::vector<std::string> hosts;
+    for (const FetchGitApp & fga : fetchGitApps)
+    {
+        hosts.push_back(hostFromUrl(pool.get(fga.url).str()));
+    }
 
-    auto strResult = findStringFromApp(fga.app, "url");
-    if (!strResult.second) { return result; }
-    fga.urlString = strResult.first;
+    std::vector<GitRevisionInfo> prefetchResults(fetchGitApps.size());
+    std::vector<GitRevisionInfo> results(fetchGitApps.size());
+    std::vector<std::string> unsupported(fetchGitApps.size());
+    scheduler.run(hosts, [&](size_t i) {
+        const FetchGitApp & fga = fetchGitApps[i];
+        std::string url = pool.get(fga.url).str();
+        prefetchResults[i] = prefetchGitRevision(url, "", fga.args, fetch.quiet);
+        try
+        {
+            results[i] = fetchGitRevision(url, prefetchResults[i].rev, fga.args,
+                fetch.quiet);
+        }
+        catch (const UnsupportedCheckoutError & e)
+        {
+            unsupported[i] = e.what();
+        }
+    });
 
-    strResult = findStringFromApp(fga.app, "rev");
-    if (!strResult.second) { return result; }
-    fga.revString = strResult.first;
+    if (!fetch.quiet)
+    {
+        std::cerr << "Fetch statistics:" << std::endl;
+        scheduler.printStats(std::cerr);
+    }
 
-    strResult = findStringFromApp(fga.app, "sha256");
-    if (!strResult.second) { return result; }
-    fga.hashString = strResult.first;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < fetchGitApps.size(); i++)
+    {
+        const FetchGitApp & fga = fetchGitApps[i];
+        if (!unsupported[i].empty())
+        {
+            std::cerr << "Cannot compare the hashes for " << pool.get(fga.url)
+                      << ": " << unsupported[i] << std::endl;
+            continue;
+        }
+        if (prefetchResults[i].sha256 == results[i].sha256) { continue; }
+        mismatches++;
+        std::cerr << "Hash mismatch for " << pool.get(fga.url)
+                  << " at " << prefetchResults[i].rev << ":" << std::endl
+                  << "  nix-prefetch-git: " << prefetchResults[i].sha256 << std::endl
+                  << "  in-process:       " << results[i].sha256 << std::endl;
+    }
 
-    result.second = true;
-    return result;
+    if (mismatches > 0)
+    {
+        throw std::runtime_error(std::to_string(mismatches) +
+            " in-process hashes did not match nix-prefetch-git.");
+    }
+    if (!fetch.quiet)
+    {
+        std::cerr << "All hashes match: " << options.path << std::endl;
+    }
+    return 0;
 }
 
-// Use nix-prefetch-git to get updated info about the upstream repository.
-// (Requires internet access.)
-void getLatestGitInfo(FetchGitApp & fga, nix::EvalState & state, bool quiet)
+// Checks whether the sha256 in a file is the hash that was fetched.  The
+// file can spell it in base 16 or base 32, so both sides are parsed; a
+// hash in the file that does not parse does not match.
+static bool sameHash(const std::string & inFile, const std::string & fetched)
 {
-    // Prevent security problems when assembling the shell command below.
-    if (fga.urlString.string().find('\'') != std::string::npos)
+    try
     {
-        throw std::runtime_error("Git repository name has a single quote in it.");
+        return nix::parseHash16or32(nix::htSHA256, inFile) ==
+            nix::parseHash16or32(nix::htSHA256, fetched);
     }
+    catch (const nix::Error &)
+    {
+        return false;
+    }
+}
 
-    // Fetch the info from the git repository.
-    std::string cmd = "nix-prefetch-git ";
-    cmd += std::string("\'") + fga.urlString.string() + std::string("\'");
-    if (quiet) { cmd += " 2>/dev/null"; }
-
-    std::string json = runShellCommand(cmd);
-
-    // Parse the JSON returned from nix-prefetch-git using nix's JSON parser.
-    nix::Value value;
-    parseJSON(state, json, value);
-    if (value.type != nix::ValueType::tAttrs)
+// Fetches every call site at the revision it already names, with the
+// same fetchSubmodules, deepClone and leaveDotGit, and checks that the
+// hash in the file is still right.  The queue only fetches each URL and
+// revision once.  A call site that cannot be fetched is reported and the
+// others are still checked.  So is a call site whose arguments are not
+// known, which cannot be verified.  The file is not modified.
+int verifyHashes(const std::vector<FetchGitApp> & fetchGitApps,
+    StringPool & pool, FetchGitQueue & queue, const NixUpdateGitOptions & options)
+{
+    std::vector<std::shared_future<GitRevisionInfo>> results;
+    for (const FetchGitApp & fga : fetchGitApps)
     {
-        throw std::runtime_error("JSON from nix-prefetch-git is not a hash.");
+        if (!fga.argsKnown)
+        {
+            results.push_back(std::shared_future<GitRevisionInfo>());
+            continue;
+        }
+        results.push_back(queue.fetch(pool.get(fga.url).str(),
+            pool.get(fga.rev).inner().str(), fga.args));
     }
 
-    // Make sure the url from the JSON response is what we are expecting.
-    auto result = findStringFromBindings(*value.attrs, "url");
-    if (!result.second)
+    size_t mismatches = 0;
+    size_t fetchErrors = 0;
+    size_t unverifiable = 0;
+    for (size_t i = 0; i < fetchGitApps.size(); i++)
     {
-        throw std::runtime_error("JSON from nix-prefetch-git is missing the key 'url'.");
+        const FetchGitApp & fga = fetchGitApps[i];
+        if (!results[i].valid())
+        {
+            unverifiable++;
+            std::cerr << options.path << ":" << fga.revLine << ":" << fga.revColumn
+                      << ": cannot verify " << pool.get(fga.url)
+                      << " because its fetchSubmodules, deepClone or leaveDotGit"
+                      << " is not simply true or false" << std::endl;
+            continue;
+        }
+
+        GitRevisionInfo result;
+        try
+        {
+            result = results[i].get();
+        }
+        catch (const std::exception & e)
+        {
+            fetchErrors++;
+            std::cerr << options.path << ":" << fga.revLine << ":" << fga.revColumn
+                      << ": fetch failed for " << pool.get(fga.url)
+                      << " at " << pool.get(fga.rev).inner() << ": "
+                      << e.what() << std::endl;
+            continue;
+        }
+
+        StringRef hash = pool.get(fga.hash).inner();
+        if (sameHash(hash.str(), result.sha256)) { continue; }
+        mismatches++;
+        std::cerr << options.path << ":" << fga.hashLine << ":" << fga.hashColumn
+                  << ": hash mismatch for " << pool.get(fga.url)
+                  << " at " << pool.get(fga.rev).inner() << ":" << std::endl
+                  << "  in file: " << hash << std::endl
+                  << "  fetched: " << result.sha256 << std::endl;
     }
-    if (result.first != fga.urlString.string())
+
+    if (!options.fetch.quiet)
     {
-        throw std::runtime_error("JSON from nix-prefetch-git has a url that does "
-            "not match what we expected.");
+        std::cerr << "Fetch statistics:" << std::endl;
+        queue.printStats(std::cerr);
     }
 
-    // Get the rev and sha256 values and store them in fga.
-    result = findStringFromBindings(*value.attrs, "rev");
-    if (!result.second)
+    if (mismatches > 0 || fetchErrors > 0)
     {
-        throw std::runtime_error("JSON from nix-prefetch-git is missing the key 'rev'.");
+        throw std::runtime_error("Verifying " + options.path + " failed: " +
+            std::to_string(mismatches) + " hashes are out of date and " +
+            std::to_string(fetchErrors) + " call sites could not be fetched.");
     }
-    fga.newRev = result.first;
-    result = findStringFromBindings(*value.attrs, "sha256");
-    if (!result.second)
+    if (!options.fetch.quiet)
     {
-        throw std::runtime_error("JSON from nix-prefetch-git is missing the key 'sha256'.");
+        std::cerr << "All hashes verified: " << options.path;
+        if (unverifiable > 0)
+        {
+            std::cerr << " (except " << unverifiable << " call sites that "
+                      << "could not be verified)";
+        }
+        std::cerr << std::endl;
     }
-    fga.newHash = result.first;
-}
-
-std::vector<StringReplacement> getStringReplacements(const FetchGitApp & app)
-{
-    std::vector<StringReplacement> r;
-    r.push_back(app.revString.replacement(app.newRev));
-    r.push_back(app.hashString.replacement(app.newHash));
-    return r;
+    return 0;
 }
 
 NixUpdateGitOptions parseArgs(int argc, char ** argv)
@@ -134,7 +226,49 @@ NixUpdateGitOptions parseArgs(int argc, char ** argv)
         }
         else if (*arg == "--quiet" || *arg == "-q")
         {
-            options.quiet = true;
+            options.fetch.quiet = true;
+        }
+        else if (*arg == "--jobs" || *arg == "-j")
+        {
+            std::string jobs = nix::getArg(*arg, arg, end);
+            if (!nix::string2Int(jobs, options.fetch.jobs) || options.fetch.jobs == 0)
+            {
+                throw nix::UsageError("--jobs requires a positive number");
+            }
+        }
+        else if (*arg == "--per-host-jobs")
+        {
+            std::string jobs = nix::getArg(*arg, arg, end);
+            if (!nix::string2Int(jobs, options.fetch.perHostJobs) || options.fetch.perHostJobs == 0)
+            {
+                throw nix::UsageError("--per-host-jobs requires a positive number");
+            }
+        }
+        else if (*arg == "--per-host-rate")
+        {
+            std::string rate = nix::getArg(*arg, arg, end);
+            char * rateEnd = nullptr;
+            options.fetch.perHostRate = strtod(rate.c_str(), &rateEnd);
+            if (rate.empty() || *rateEnd != 0 || !(options.fetch.perHostRate > 0))
+            {
+                throw nix::UsageError("--per-host-rate requires a positive number");
+            }
+        }
+        else if (*arg == "--in-process")
+        {
+            options.fetch.inProcess = true;
+        }
+        else if (*arg == "--verify")
+        {
+            options.verify = true;
+        }
+        else if (*arg == "--compare-hashers")
+        {
+            options.compareHashers = true;
+        }
+        else if (arg->compare(0, 8, "--trace=") == 0)
+        {
+            options.tracePath = arg->substr(8);
         }
         else if (*arg != "" && arg->at(0) == '-')
         {
@@ -161,52 +295,63 @@ NixUpdateGitOptions parseArgs(int argc, char ** argv)
 
 int nixUpdateGit(const NixUpdateGitOptions & options)
 {
-    // Open the .nix file and parse it.
+    // Open the .nix file, parse it, and gather information about all
+    // calls (applications) of fetchgit.
     nix::Strings searchPath;
     nix::EvalState state(searchPath);
-    nix::Expr * mainExpr = state.parseExprFromFile(options.path);
-
-    // Traverse the parsed representation of the file and gather
-    // information about all calls (applications) of fetchgit.
-    std::vector<FetchGitApp> fetchGitApps;
-    ExprVisitorFunction finder([&](nix::Expr * e) {
-        auto result = tryInterpretAsFetchGitApp(e);
-        if (result.second) { fetchGitApps.push_back(result.first); }
-        return true;
-    });
-    ExprDepthFirstSearch(&finder).visit(mainExpr);
 
-    // Get updated info about the upstream repository.  (Requires internet access.)
-    for (FetchGitApp & fga : fetchGitApps)
+    StringPool pool;
+    std::string contentsHash;
+    std::vector<FetchGitApp> fetchGitApps =
+        scanFetchGitFile(state, options.path, pool, contentsHash);
+
+    if (options.compareHashers)
     {
-        getLatestGitInfo(fga, state, options.quiet);
+        return compareHashers(fetchGitApps, pool, options);
     }
 
-    // Get the info about what replacements need to be made in the file.
-    std::vector<StringReplacement> replacements;
-    for (FetchGitApp & fga : fetchGitApps)
+    FetchGitQueue queue(options.fetch);
+
+    if (options.verify)
     {
-        for (const StringReplacement & sr : getStringReplacements(fga))
-        {
-            if (sr.newString != sr.oldString)
-            {
-                replacements.push_back(sr);
-            }
-        }
+        return verifyHashes(fetchGitApps, pool, queue, options);
+    }
+
+    // Get updated info about the upstream repositories in parallel.
+    // (Requires internet access.)
+    updateFetchGitApps(queue, fetchGitApps, pool);
+    if (!options.fetch.quiet)
+    {
+        std::cerr << "Fetch statistics:" << std::endl;
+        queue.printStats(std::cerr);
+    }
+
+    // Update the .nix file if needed.  Other runners might be updating
+    // the same file, so this re-plans any replacements that their changes
+    // got in the way of.
+    bool changed = false;
+    for (const FetchGitApp & fga : fetchGitApps)
+    {
+        if (fga.newRev != fga.rev || fga.newHash != fga.hash) { changed = true; }
     }
 
-    // Update the .nix file if needed.
-    if (replacements.size() > 0)
+    if (changed)
     {
-        performReplacements(options.path, replacements);
-        if (!options.quiet)
+        size_t replanned = writeFetchGitApps(state, options.path, contentsHash,
+            fetchGitApps, pool);
+        if (!options.fetch.quiet)
         {
+            if (replanned > 0)
+            {
+                std::cerr << "Re-planned " << replanned << " replacements because "
+                          << "the file changed while fetching." << std::endl;
+            }
             std::cerr << "Updated: " << options.path << std::endl;
         }
     }
     else
     {
-        if (!options.quiet)
+        if (!options.fetch.quiet)
         {
             std::cerr << "Already up-to-date: " << options.path << std::endl;
         }
@@ -230,7 +375,31 @@ int mainWithExceptions(int argc, char ** argv)
         return 0;
     }
 
-    return nixUpdateGit(options);
+    if (options.tracePath.empty())
+    {
+        return nixUpdateGit(options);
+    }
+
+    // Write the trace even if the update fails, since that is often when
+    // it is most interesting.
+    setTraceEnabled(true);
+    int result;
+    try
+    {
+        result = nixUpdateGit(options);
+    }
+    catch (...)
+    {
+        writeTrace(options.tracePath);
+        throw;
+    }
+    writeTrace(options.tracePath);
+    if (!options.fetch.quiet)
+    {
+        std::cerr << "Trace written to " << options.tracePath << ":" << std::endl;
+        printTraceCounters(std::cerr);
+    }
+    return result;
 }
 
 int main(int argc, char ** argv)
@@ -1,13 +1,25 @@
 #pragma once
 
 // headers from this project
+#include "constant-resolver.hh"
 #include "expr-helpers.hh"
+#include "fetchgit-updater.hh"
+#include "git-hash.hh"
+#include "host-scheduler.hh"
+#include "json-fields.hh"
 #include "libupdate.hh"
+#include "locked-file.hh"
+#include "trace.hh"
 
 // headers from nix
-#include <json-to-value.hh>
+#include <eval.hh>
+#include <hash.hh>
 #include <shared.hh>
+#include <util.hh>
 
 // standard headers
+#include <cstdlib>
 #include <iostream>
+#include <map>
+#include <thread>
 
@@ -0,0 +1,429 @@
+#include "string-literal.hh"
+
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+static bool startsWith(const std::string & source, size_t i, const char * prefix)
+{
+    size_t length = strlen(prefix);
+    return i + length <= source.size() && source.compare(i, length, prefix) == 0;
+}
+
+static void throwUnterminated()
+{
+    throw std::runtime_error("Unterminated string or comment in nix file.");
+}
+
+static bool isIdentifierChar(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '_' || c == '\'' || c == '-';
+}
+
+// Skips whitespace and comments.
+static size_t skipSpace(const std::string & source, size_t i)
+{
+    while (i < source.size())
+    {
+        char c = source[i];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+        {
+            i++;
+        }
+        else if (c == '#')
+        {
+            while (i < source.size() && source[i] != '\n') { i++; }
+        }
+        else if (startsWith(source, i, "/*"))
+        {
+            size_t end = source.find("*/", i + 2);
+            if (end == std::string::npos) { throwUnterminated(); }
+            i = end + 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+// Skips an antiquotation, "${ ... }", which starts at the given offset.
+static size_t skipAntiquote(const std::string & source, size_t i)
+{
+    i += 2;
+    unsigned int depth = 1;
+    while (1)
+    {
+        i = skipSpace(source, i);
+        if (i >= source.size()) { throwUnterminated(); }
+        if (source[i] == '"' || startsWith(source, i, "''"))
+        {
+            i = findStringLiteral(source, i).end;
+        }
+        else if (source[i] == '{')
+        {
+            depth++;
+            i++;
+        }
+        else if (source[i] == '}')
+        {
+            i++;
+            if (--depth == 0) { return i; }
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+LiteralRange findStringLiteral(const std::string & source, size_t offset)
+{
+    LiteralRange range;
+    range.begin = offset;
+    size_t i = offset;
+
+    if (startsWith(source, i, "\""))
+    {
+        i++;
+        while (1)
+        {
+            if (i >= source.size()) { throwUnterminated(); }
+            if (source[i] == '"')
+            {
+                range.end = i + 1;
+                return range;
+            }
+            if (source[i] == '\\') { i += 2; }
+            else if (startsWith(source, i, "$$")) { i += 2; }
+            else if (startsWith(source, i, "${")) { i = skipAntiquote(source, i); }
+            else { i++; }
+        }
+    }
+
+    if (startsWith(source, i, "''"))
+    {
+        i += 2;
+        while (1)
+        {
+            if (i >= source.size()) { throwUnterminated(); }
+            if (startsWith(source, i, "'''")) { i += 3; }
+            else if (startsWith(source, i, "''$")) { i += 3; }
+            else if (startsWith(source, i, "''\\")) { i += 4; }
+            else if (startsWith(source, i, "''"))
+            {
+                range.end = i + 2;
+                return range;
+            }
+            else if (startsWith(source, i, "$$")) { i += 2; }
+            else if (startsWith(source, i, "${")) { i = skipAntiquote(source, i); }
+            else { i++; }
+        }
+    }
+
+    throw std::runtime_error("Expected a string literal in nix file.");
+}
+
+LiteralRange findAttrValueLiteral(const std::string & source, size_t offset)
+{
+    // Skip the attribute path, which is a series of names separated by
+    // dots.  A name can be an identifier, a string, or an antiquotation.
+    size_t i = offset;
+    while (1)
+    {
+        i = skipSpace(source, i);
+        if (i >= source.size())
+        {
+            throw std::runtime_error("Expected an attribute name in nix file.");
+        }
+        if (source[i] == '"')
+        {
+            i = findStringLiteral(source, i).end;
+        }
+        else if (startsWith(source, i, "${"))
+        {
+            i = skipAntiquote(source, i);
+        }
+        else
+        {
+            size_t start = i;
+            while (i < source.size() && isIdentifierChar(source[i])) { i++; }
+            if (i == start)
+            {
+                throw std::runtime_error("Expected an attribute name in nix file.");
+            }
+        }
+
+        i = skipSpace(source, i);
+        if (i < source.size() && source[i] == '.')
+        {
+            i++;
+            continue;
+        }
+        break;
+    }
+
+    if (i >= source.size() || source[i] != '=')
+    {
+        throw std::runtime_error("Expected '=' after attribute name in nix file.");
+    }
+    return findStringLiteral(source, skipSpace(source, i + 1));
+}
+
+// The value of a backslash escape sequence, as nix's unescapeStr sees it.
+static char unescape(char c)
+{
+    if (c == 'n') { return '\n'; }
+    if (c == 'r') { return '\r'; }
+    if (c == 't') { return '\t'; }
+    return c;
+}
+
+// Decodes an antiquotation at the given offset if it only contains a
+// string literal, and moves the offset past it.
+static bool decodeAntiquote(const std::string & source, size_t & i,
+    std::string & value)
+{
+    size_t j = skipSpace(source, i + 2);
+    if (j >= source.size()) { return false; }
+    if (source[j] != '"' && !startsWith(source, j, "''")) { return false; }
+
+    LiteralRange inner = findStringLiteral(source, j);
+    if (!decodeStringLiteral(source, inner, value)) { return false; }
+
+    j = skipSpace(source, inner.end);
+    if (j >= source.size() || source[j] != '}') { return false; }
+    i = j + 1;
+    return true;
+}
+
+namespace
+{
+    // A piece of an indented string, corresponding to one of the pieces
+    // that the nix lexer produces: literal text, an escape sequence, or
+    // an antiquotation.
+    struct IndStrPart
+    {
+        bool antiquote;
+        std::string text;
+    };
+}
+
+// Removes the common indentation from the parts of an indented string.
+// This follows stripIndentation in nix's parser.
+static std::string stripIndentation(const std::vector<IndStrPart> & parts)
+{
+    // Figure out the minimum indentation.  Whitespace-only lines are not
+    // taken into account.
+    bool atStartOfLine = true;
+    size_t minIndent = 1000000;
+    size_t curIndent = 0;
+    for (const IndStrPart & part : parts)
+    {
+        if (part.antiquote)
+        {
+            // Antiquotations end the current start-of-line whitespace.
+            if (atStartOfLine)
+            {
+                atStartOfLine = false;
+                if (curIndent < minIndent) { minIndent = curIndent; }
+            }
+            continue;
+        }
+
+        for (char c : part.text)
+        {
+            if (atStartOfLine)
+            {
+                if (c == ' ') { curIndent++; }
+                else if (c == '\n') { curIndent = 0; }
+                else
+                {
+                    atStartOfLine = false;
+                    if (curIndent < minIndent) { minIndent = curIndent; }
+                }
+            }
+            else if (c == '\n')
+            {
+                atStartOfLine = true;
+                curIndent = 0;
+            }
+        }
+    }
+
+    // Strip the spaces from each line.
+    std::string result;
+    atStartOfLine = true;
+    size_t curDropped = 0;
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+        const IndStrPart & part = parts[i];
+        if (part.antiquote)
+        {
+            atStartOfLine = false;
+            curDropped = 0;
+            result += part.text;
+            continue;
+        }
+
+        std::string stripped;
+        for (char c : part.text)
+        {
+            if (atStartOfLine)
+            {
+                if (c == ' ')
+                {
+                    if (curDropped++ >= minIndent) { stripped += c; }
+                }
+                else if (c == '\n')
+                {
+                    curDropped = 0;
+                    stripped += c;
+                }
+                else
+                {
+                    atStartOfLine = false;
+                    curDropped = 0;
+                    stripped += c;
+                }
+            }
+            else
+            {
+                stripped += c;
+                if (c == '\n') { atStartOfLine = true; }
+            }
+        }
+
+        // Remove the last line if it is empty and consists only of spaces.
+        if (i == parts.size() - 1)
+        {
+            size_t p = stripped.find_last_of('\n');
+            if (p != std::string::npos &&
+                stripped.find_first_not_of(' ', p + 1) == std::string::npos)
+            {
+                stripped.resize(p + 1);
+            }
+        }
+
+        result += stripped;
+    }
+    return result;
+}
+
+bool decodeStringLiteral(const std::string & source, LiteralRange range,
+    std::string & value)
+{
+    value.clear();
+    size_t i = range.begin;
+
+    if (source[i] == '"')
+    {
+        size_t end = range.end - 1;
+        i++;
+        while (i < end)
+        {
+            char c = source[i];
+            if (c == '\\')
+            {
+                value += unescape(source[i + 1]);
+                i += 2;
+            }
+            else if (c == '\r')
+            {
+                // The nix lexer turns CR and CR LF into LF.
+                value += '\n';
+                i++;
+                if (i < end && source[i] == '\n') { i++; }
+            }
+            else if (startsWith(source, i, "$$"))
+            {
+                value += "$$";
+                i += 2;
+            }
+            else if (startsWith(source, i, "${"))
+            {
+                std::string inner;
+                if (!decodeAntiquote(source, i, inner)) { return false; }
+                value += inner;
+            }
+            else
+            {
+                value += c;
+                i++;
+            }
+        }
+        return true;
+    }
+
+    // An indented string.  The lexer drops any spaces and the newline
+    // that directly follow the opening quotes.
+    size_t end = range.end - 2;
+    i += 2;
+    size_t j = i;
+    while (j < end && source[j] == ' ') { j++; }
+    if (j < end && source[j] == '\n') { i = j + 1; }
+
+    std::vector<IndStrPart> parts;
+    bool inText = false;
+    while (i < end)
+    {
+        IndStrPart part;
+        part.antiquote = false;
+        if (startsWith(source, i, "'''"))
+        {
+            part.text = "''";
+            i += 3;
+        }
+        else if (startsWith(source, i, "''$"))
+        {
+            part.text = "$";
+            i += 3;
+        }
+        else if (startsWith(source, i, "''\\"))
+        {
+            part.text = std::string(1, unescape(source[i + 3]));
+            i += 4;
+        }
+        else if (startsWith(source, i, "${"))
+        {
+            part.antiquote = true;
+            if (!decodeAntiquote(source, i, part.text)) { return false; }
+        }
+        else
+        {
+            // Ordinary text is collected into one part.
+            size_t length = startsWith(source, i, "$$") ? 2 : 1;
+            if (!inText) { parts.push_back(part); }
+            parts.back().text.append(source, i, length);
+            i += length;
+            inText = true;
+            continue;
+        }
+        parts.push_back(part);
+        inText = false;
+    }
+
+    value = stripIndentation(parts);
+    return true;
+}
+
+std::string encodeStringLiteral(const std::string & value)
+{
+    std::string literal;
+    literal.reserve(value.size() + 2);
+    literal += '"';
+    for (char c : value)
+    {
+        // Every dollar sign is escaped so that none can start an
+        // antiquotation.
+        if (c == '"' || c == '\\' || c == '$') { literal += '\\'; literal += c; }
+        else if (c == '\n') { literal += "\\n"; }
+        else if (c == '\r') { literal += "\\r"; }
+        else if (c == '\t') { literal += "\\t"; }
+        else { literal += c; }
+    }
+    literal += '"';
+    return literal;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/** The location of a string literal in nix source code, as byte offsets.
+ * The range includes the quotes. */
+struct LiteralRange
+{
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+/** Finds the string literal that is assigned to an attribute.  The offset
+ * must point at the start of the attribute path, which is where nix
+ * places the position of an attribute definition.  The literal can be a
+ * "double-quoted" or ''indented'' string and can span multiple lines.
+ * Throws an exception if the attribute's value is not a string literal. */
+LiteralRange findAttrValueLiteral(const std::string & source, size_t offset);
+
+/** Finds the extent of the string literal starting at the given offset. */
+LiteralRange findStringLiteral(const std::string & source, size_t offset);
+
+/** Computes the value of a string literal the way the nix parser would,
+ * including escape sequences and the indentation stripping of indented
+ * strings.  Antiquotations are allowed if they only contain string
+ * literals.  Returns false if the value cannot be determined statically. */
+bool decodeStringLiteral(const std::string & source, LiteralRange range,
+    std::string & value);
+
+/** Writes a "double-quoted" string literal that the nix parser reads back
+ * as the given value, escaping quotes, backslashes, dollar signs and
+ * control characters. */
+std::string encodeStringLiteral(const std::string & value);
@@ -0,0 +1,101 @@
+#include "string-pool.hh"
+
+#include <ostream>
+#include <stdexcept>
+
+// The size of the blocks that hold the characters.  Longer strings get a
+// block of their own.
+static const size_t defaultBlockSize = 64 * 1024;
+
+std::ostream & operator << (std::ostream & str, const StringRef & ref)
+{
+    return str.write(ref.data, ref.size);
+}
+
+size_t StringPool::StringRefHash::operator () (const StringRef & ref) const
+{
+    // FNV-1a.
+    size_t hash = 2166136261u;
+    for (uint32_t i = 0; i < ref.size; i++)
+    {
+        hash = (hash ^ (unsigned char)ref.data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+StringPool::StringPool() : block(nullptr), blockUsed(0), blockSize(0), totalBytes(0)
+{
+}
+
+StringPool::Id StringPool::intern(const char * data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return internLocked(data, size);
+}
+
+StringPool::Id StringPool::internQuoted(const std::string & str)
+{
+    std::string quoted;
+    quoted.reserve(str.size() + 2);
+    quoted += '"';
+    quoted += str;
+    quoted += '"';
+    return intern(quoted);
+}
+
+StringPool::Id StringPool::internLocked(const char * data, size_t size)
+{
+    if (size > UINT32_MAX)
+    {
+        throw std::length_error("String is too long for the string pool.");
+    }
+
+    auto it = index.find(StringRef(data, size));
+    if (it != index.end()) { return it->second; }
+
+    // Copy the characters into the current block, or start a new one.
+    char * copy;
+    if (size > defaultBlockSize)
+    {
+        blocks.push_back(std::unique_ptr<char[]>(new char[size]));
+        copy = blocks.back().get();
+    }
+    else
+    {
+        if (block == nullptr || blockSize - blockUsed < size)
+        {
+            blocks.push_back(std::unique_ptr<char[]>(new char[defaultBlockSize]));
+            block = blocks.back().get();
+            blockUsed = 0;
+            blockSize = defaultBlockSize;
+        }
+        copy = block + blockUsed;
+        blockUsed += size;
+    }
+    memcpy(copy, data, size);
+    totalBytes += size;
+
+    Id id = strings.size();
+    StringRef ref(copy, size);
+    strings.push_back(ref);
+    index[ref] = id;
+    return id;
+}
+
+StringRef StringPool::get(Id id) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return strings.at(id);
+}
+
+size_t StringPool::count() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return strings.size();
+}
+
+size_t StringPool::bytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return totalBytes;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/** A reference to characters that are owned by something else, usually
+ * a StringPool.  It is only valid for as long as its owner is. */
+struct StringRef
+{
+    const char * data = nullptr;
+    uint32_t size = 0;
+
+    StringRef() { }
+    StringRef(const char * data, uint32_t size) : data(data), size(size) { }
+
+    std::string str() const
+    {
+        return std::string(data, size);
+    }
+
+    /** For a string surrounded by quotes, returns the part between them. */
+    StringRef inner() const
+    {
+        if (size < 2) { return StringRef(); }
+        return StringRef(data + 1, size - 2);
+    }
+
+    bool operator == (const StringRef & other) const
+    {
+        return size == other.size && memcmp(data, other.data, size) == 0;
+    }
+
+    bool operator != (const StringRef & other) const
+    {
+        return !(*this == other);
+    }
+};
+
+std::ostream & operator << (std::ostream & str, const StringRef & ref);
+
+/** Stores each distinct string once for the duration of a run.  The
+ * characters are kept in large blocks and never move, so StringRefs to
+ * them stay valid until the pool is destroyed.  Strings are identified
+ * by small integer ids.  All the member functions are thread-safe. */
+class StringPool
+{
+public:
+    typedef uint32_t Id;
+
+    StringPool();
+
+    Id intern(const char * data, size_t size);
+
+    Id intern(const std::string & str)
+    {
+        return intern(str.data(), str.size());
+    }
+
+    /** Interns the string surrounded by double quotes, so that
+     * StringRef::inner gives it back.  Nothing is escaped, so the result
+     * is only a valid string literal for simple values; use
+     * encodeStringLiteral for text that is written to a .nix file. */
+    Id internQuoted(const std::string & str);
+
+    StringRef get(Id id) const;
+
+    /** Returns the number of distinct strings in the pool. */
+    size_t count() const;
+
+    /** Returns the total length of the distinct strings. */
+    size_t bytes() const;
+
+private:
+    struct StringRefHash
+    {
+        size_t operator () (const StringRef & ref) const;
+    };
+
+    Id internLocked(const char * data, size_t size);
+
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char * block;
+    size_t blockUsed, blockSize;
+    size_t totalBytes;
+    std::vector<StringRef> strings;
+    std::unordered_map<StringRef, Id, StringRefHash> index;
+};
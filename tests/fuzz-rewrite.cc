@@ -0,0 +1,52 @@
+// A libFuzzer harness for the scanner and the rewriting path.  The input
+// bytes make the choices of the generator, so every input is a valid
+// .nix file full of calls to fetchgit, and libFuzzer steers it towards
+// the forms and literals that reach new code.  Build and run it with
+// `make fuzz`.
+
+#include "rewrite-properties.hh"
+
+#include <shared.hh>
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+static nix::EvalState & getState()
+{
+    static nix::EvalState * state = nullptr;
+    if (state == nullptr)
+    {
+        nix::initNix();
+        nix::initGC();
+        nix::verbosity = nix::lvlError;
+        state = new nix::EvalState(nix::Strings());
+    }
+    return *state;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+    size_t offset = 0;
+    ChoiceFunction choose = [&](unsigned int n) -> unsigned int {
+        if (n <= 1 || offset >= size) { return 0; }
+        unsigned int value = data[offset++];
+        if (n > 256 && offset < size) { value = value << 8 | data[offset++]; }
+        return value % n;
+    };
+    GeneratedNix generated = generateFetchGitNix(choose, 8);
+
+    try
+    {
+        checkGeneratedNix(getState(), generated, size);
+    }
+    catch (const std::exception & e)
+    {
+        std::cerr << e.what() << std::endl
+                  << "--- source:" << std::endl << generated.source
+                  << "--- expected:" << std::endl << generated.expected
+                  << "---" << std::endl;
+        abort();
+    }
+    return 0;
+}
@@ -0,0 +1,248 @@
+// Tests for HostScheduler that run against fake hosts.  Each job stands
+// for a fetch and just sleeps, so this does not need nix or the network.
+
+#include "host-scheduler.hh"
+
+#include <atomic>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+typedef std::chrono::steady_clock Clock;
+
+static int failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+static void check(bool condition, const char * text, const char * file, int line)
+{
+    if (condition) { return; }
+    std::cerr << file << ":" << line << ": check failed: " << text << std::endl;
+    failures++;
+}
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void sleepFor(double seconds)
+{
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+// Counts how many jobs are running at once for one host.
+struct Gauge
+{
+    std::atomic<int> current { 0 };
+    std::atomic<int> max { 0 };
+
+    void enter()
+    {
+        int now = ++current;
+        int seen = max;
+        while (now > seen && !max.compare_exchange_weak(seen, now)) { }
+    }
+
+    void leave() { current--; }
+};
+
+static void testHostFromUrl()
+{
+    CHECK(hostFromUrl("https://github.com/NixOS/nixpkgs") == "github.com");
+    CHECK(hostFromUrl("https://user@GitHub.com:443/a/b.git") == "github.com");
+    CHECK(hostFromUrl("git://[::1]:9418/repo") == "::1");
+    CHECK(hostFromUrl("git@gitlab.com:group/repo.git") == "gitlab.com");
+    CHECK(hostFromUrl("file:///srv/git/repo") == "localhost");
+    CHECK(hostFromUrl("/srv/git/repo") == "localhost");
+    CHECK(hostFromUrl("./a:b") == "localhost");
+}
+
+// Several hosts with slow jobs: no host may run more than perHostJobs at
+// once, but the hosts run in parallel with each other.  There are more
+// threads than the hosts can use, so spreading the threads across the
+// hosts is not enough to stay within the limit.
+static void testPerHostConcurrency()
+{
+    const unsigned int perHostJobs = 2;
+    const char * const urls[] = {
+        "https://a.example/repo", "git@b.example:repo", "file:///srv/git/repo",
+    };
+    const size_t hostCount = sizeof(urls) / sizeof(urls[0]);
+
+    Gauge hosts[hostCount];
+    Gauge total;
+    {
+        HostScheduler scheduler(12, perHostJobs, 0);
+        for (unsigned int round = 0; round < 8; round++)
+        {
+            for (size_t h = 0; h < hostCount; h++)
+            {
+                scheduler.submit(hostFromUrl(urls[h]), [&, h]() {
+                    hosts[h].enter();
+                    total.enter();
+                    sleepFor(0.02);
+                    total.leave();
+                    hosts[h].leave();
+                });
+            }
+        }
+        scheduler.wait();
+    }
+
+    for (size_t h = 0; h < hostCount; h++)
+    {
+        CHECK(hosts[h].max <= (int)perHostJobs);
+    }
+    CHECK(total.max <= 12);
+    CHECK(total.max > (int)perHostJobs);
+}
+
+// One host with quick jobs and a rate limit: by the time the k-th job
+// starts, at most the full bucket plus the tokens refilled since the
+// first submission can have been used.
+static void testPerHostRate()
+{
+    const unsigned int perHostJobs = 2;
+    const double rate = 20;
+    const unsigned int jobCount = 10;
+    const double slack = 0.5;
+
+    std::mutex mutex;
+    std::vector<double> starts;
+    Clock::time_point begin = Clock::now();
+    {
+        HostScheduler scheduler(4, perHostJobs, rate);
+        for (unsigned int i = 0; i < jobCount; i++)
+        {
+            scheduler.submit("a.example", [&]() {
+                std::lock_guard<std::mutex> lock(mutex);
+                starts.push_back(secondsSince(begin));
+            });
+        }
+        scheduler.wait();
+    }
+
+    CHECK(starts.size() == jobCount);
+    for (size_t k = 0; k < starts.size(); k++)
+    {
+        CHECK(k + 1 <= perHostJobs + rate * starts[k] + slack);
+    }
+
+    // The limit is enforced, not just respected by luck.
+    double minimum = (jobCount - perHostJobs) / rate;
+    CHECK(starts.back() >= minimum * 0.8);
+}
+
+// A host whose jobs never finish until we say so must not hold up the
+// jobs for other hosts, even when it has a lot of them queued.
+static void testBlockedHost()
+{
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    std::atomic<int> fastDone { 0 };
+    std::atomic<int> slowDone { 0 };
+    Gauge slow;
+    const int fastCount = 12;
+
+    HostScheduler scheduler(4, 1, 0);
+    for (int i = 0; i < 5; i++)
+    {
+        scheduler.submit(hostFromUrl("file:///srv/slow"), [&, released]() {
+            slow.enter();
+            released.wait();
+            slowDone++;
+            slow.leave();
+        });
+    }
+    for (int i = 0; i < fastCount; i++)
+    {
+        const char * url = i % 2 ? "https://a.example/x" : "https://b.example/y";
+        scheduler.submit(hostFromUrl(url), [&]() {
+            sleepFor(0.005);
+            fastDone++;
+        });
+    }
+
+    Clock::time_point begin = Clock::now();
+    while (fastDone < fastCount && secondsSince(begin) < 5)
+    {
+        sleepFor(0.001);
+    }
+    CHECK(fastDone == fastCount);
+    CHECK(slowDone == 0);
+
+    release.set_value();
+    scheduler.wait();
+    CHECK(slowDone == 5);
+    CHECK(slow.max == 1);
+}
+
+// When a job of run fails, the rest of its jobs are dropped at once
+// instead of each waiting for a token just to be skipped, and they do not
+// show up in the statistics.
+static void testRunStopsAfterFailure()
+{
+    const size_t jobCount = 12;
+    std::atomic<int> calls { 0 };
+    HostScheduler scheduler(4, 1, 5);
+    std::vector<std::string> hosts(jobCount, "a.example");
+
+    Clock::time_point begin = Clock::now();
+    bool threw = false;
+    try
+    {
+        scheduler.run(hosts, [&](size_t i) {
+            calls++;
+            if (i == 0) { throw std::runtime_error("fetch failed"); }
+        });
+    }
+    catch (const std::runtime_error &)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+    CHECK(calls == 1);
+    CHECK(secondsSince(begin) < 1);
+
+    std::ostringstream stats;
+    scheduler.printStats(stats);
+    CHECK(stats.str().find(" 1 fetched, 1 failed") != std::string::npos);
+}
+
+// Cancelled jobs never run, and wait() does not wait for them.
+static void testCancelPending()
+{
+    std::atomic<int> calls { 0 };
+    HostScheduler scheduler(2, 1, 2);
+    for (int i = 0; i < 6; i++)
+    {
+        scheduler.submit("a.example", [&]() { calls++; });
+    }
+
+    Clock::time_point begin = Clock::now();
+    size_t cancelled = scheduler.cancelPending();
+    scheduler.wait();
+    CHECK(cancelled >= 4);
+    CHECK(calls + cancelled == 6);
+    CHECK(secondsSince(begin) < 1);
+}
+
+int main()
+{
+    testHostFromUrl();
+    testPerHostConcurrency();
+    testPerHostRate();
+    testBlockedHost();
+    testRunStopsAfterFailure();
+    testCancelPending();
+
+    if (failures)
+    {
+        std::cerr << failures << " checks failed." << std::endl;
+        return 1;
+    }
+    std::cout << "host-scheduler-test: all checks passed." << std::endl;
+    return 0;
+}
@@ -0,0 +1,823 @@
+#include "nix-generator.hh"
+#include "string-literal.hh"
+
+#include <algorithm>
+
+namespace
+{
+    enum Layout { SingleLine, MultiLine, Commented, LayoutCount };
+
+    // Pieces of the values in "double-quoted" strings, which can hold
+    // anything.
+    const char * const plainPieces[] = {
+        "0", "7", "a", "f", "z", "\"", "\\", "$", "${", "$$", "}", "''",
+        "\n", "\r", "\t", " ", "#", "/*", "*/", "\xc3\xa9",
+    };
+
+    // Pieces of the values in ''indented'' strings, and how they are
+    // spelled there.  Single quotes and dollar signs only appear in
+    // escapes, so that pieces cannot run together into something else,
+    // and no piece starts with a space, which would change the
+    // indentation.
+    struct IndentedPiece
+    {
+        const char * value;
+        const char * text;
+    };
+
+    const IndentedPiece indentedPieces[] = {
+        { "a", "a" }, { "z", "z" }, { "0", "0" }, { "9", "9" },
+        { "-", "-" }, { ".", "." }, { "/", "/" }, { "\"", "\"" },
+        { "\\", "\\" }, { "#", "#" }, { "$", "''$" }, { "''", "'''" },
+        { "\xc3\xa9", "\xc3\xa9" },
+    };
+
+    template <class T, size_t N> unsigned int countOf(T (&)[N]) { return N; }
+
+    // A string literal: its value, and how it is spelled in the source.
+    struct Literal
+    {
+        std::string value;
+        std::string text;
+    };
+
+    // A call being generated, and the literals of its arguments.
+    struct Call
+    {
+        GeneratedCall record;
+        Literal url, rev, sha256;
+    };
+
+    // The generated source, and the same source as it should be after
+    // the rewritten literals have been replaced.
+    struct Writer
+    {
+        std::string source;
+        std::string expected;
+
+        void text(const std::string & s)
+        {
+            source += s;
+            expected += s;
+        }
+
+        void append(const Writer & w)
+        {
+            source += w.source;
+            expected += w.expected;
+        }
+    };
+
+    typedef std::function<void(Writer &)> Emitter;
+
+    class Generator
+    {
+    public:
+        explicit Generator(const ChoiceFunction & choose)
+            : choose(choose), layout(choose(LayoutCount))
+        {
+        }
+
+        GeneratedNix generate(unsigned int maxCalls);
+
+    private:
+        void space(Writer & w);
+        std::string value();
+        std::string differentValue(const std::string & old);
+        Literal literal();
+        Literal plainLiteral(const std::string & value);
+        Call newCall();
+        std::string newName(const char * prefix);
+
+        void emit(Writer & w, const Literal & l, const std::string * newValue);
+        void beginAttr(Writer & w, const std::string & name);
+        void endAttr(Writer & w);
+        void literalAttr(Writer & w, const std::string & name, const Literal & l,
+            const std::string * newValue);
+        void exprAttr(Writer & w, const std::string & name, const std::string & expr);
+        void inherit(Writer & w, const std::string & from,
+            const std::vector<std::string> & names);
+        void passVariables(std::vector<Emitter> & args,
+            const std::vector<std::string> & names);
+        void fetchgit(Writer & w, std::vector<Emitter> args);
+        void letIn(Writer & w, std::vector<Emitter> bindings);
+
+        void directCall();
+        void letBoundCall();
+        void globalLetCall();
+        void inheritFromCall();
+        void mergedCall();
+        void recCall();
+        void selectedCall();
+        void sharedCalls();
+        void usedElsewhereCall();
+        void parenthesizedCall();
+        void functionArgumentCall();
+        void plainFunctionCall();
+        void fetchurlCall();
+
+        const ChoiceFunction & choose;
+        unsigned int layout;
+        unsigned int nameCount = 0;
+        Writer bindings;
+        Writer body;
+        std::vector<GeneratedCall> calls;
+    };
+}
+
+// Whitespace, and in some layouts comments, between two tokens.  There is
+// always at least one character, so that words stay apart.
+void Generator::space(Writer & w)
+{
+    static const char * const singleLine[] = { " ", " ", " ", " /* c */ " };
+    static const char * const multiLine[] = { " ", "\n  ", "\n\n    ", "\t" };
+    static const char * const commented[] = {
+        " ", "\n  ", " # rev = \"decoy\"; sha256 = ''x'';\n  ",
+        " /* url = \"${x}\"; */ ", "\n  /* several\n     lines */\n  ", " #\n",
+    };
+    switch (layout)
+    {
+    case SingleLine: w.text(singleLine[choose(countOf(singleLine))]); break;
+    case MultiLine: w.text(multiLine[choose(countOf(multiLine))]); break;
+    default: w.text(commented[choose(countOf(commented))]); break;
+    }
+}
+
+std::string Generator::value()
+{
+    std::string v;
+    unsigned int length = choose(12);
+    for (unsigned int i = 0; i < length; i++)
+    {
+        v += plainPieces[choose(countOf(plainPieces))];
+    }
+    return v;
+}
+
+std::string Generator::differentValue(const std::string & old)
+{
+    std::string v = value();
+    if (v == old) { v += "x"; }
+    return v;
+}
+
+// Spells a value as a "double-quoted" string, either the way
+// encodeStringLiteral does or with other escapes and raw line breaks.
+Literal Generator::plainLiteral(const std::string & value)
+{
+    Literal l;
+    l.value = value;
+    if (choose(2)) { l.text = encodeStringLiteral(value); return l; }
+
+    l.text = "\"";
+    for (char c : value)
+    {
+        switch (c)
+        {
+        case '"': l.text += "\\\""; break;
+        case '\\': l.text += "\\\\"; break;
+        case '$': l.text += "\\$"; break;
+        case '\r': l.text += "\\r"; break;
+        case '\n': l.text += choose(2) ? "\n" : "\\n"; break;
+        case '\t': l.text += choose(2) ? "\t" : "\\t"; break;
+        default: l.text += c; break;
+        }
+    }
+    l.text += "\"";
+    return l;
+}
+
+// Makes up a literal in one of the styles nix has.
+Literal Generator::literal()
+{
+    Literal l;
+    switch (choose(4))
+    {
+    case 0:
+    {
+        // ''on one line''
+        l.text = "''";
+        unsigned int length = choose(8);
+        for (unsigned int i = 0; i < length; i++)
+        {
+            const IndentedPiece & piece = indentedPieces[choose(countOf(indentedPieces))];
+            l.value += piece.value;
+            l.text += piece.text;
+        }
+        l.text += "''";
+        return l;
+    }
+    case 1:
+    {
+        // ''
+        //   on several lines, which nix strips the indentation from
+        // ''
+        l.text = "''\n";
+        unsigned int lines = 1 + choose(3);
+        for (unsigned int line = 0; line < lines; line++)
+        {
+            l.text += "    ";
+            unsigned int length = 1 + choose(6);
+            for (unsigned int i = 0; i < length; i++)
+            {
+                const IndentedPiece & piece = indentedPieces[choose(countOf(indentedPieces))];
+                l.value += piece.value;
+                l.text += piece.text;
+            }
+            l.value += "\n";
+            l.text += "\n";
+        }
+        l.text += "  ''";
+        return l;
+    }
+    case 2:
+    {
+        // "${"antiquoted"}pieces"
+        std::string first = value();
+        std::string rest = value() + "r";
+        std::string restText = encodeStringLiteral(rest);
+        l.value = first + rest;
+        l.text = "\"${" + std::string(choose(2) ? " " : "") +
+            encodeStringLiteral(first) + "}" +
+            restText.substr(1, restText.size() - 2) + "\"";
+        return l;
+    }
+    default:
+        return plainLiteral(value());
+    }
+}
+
+Call Generator::newCall()
+{
+    Call c;
+    c.record.url = "https://host" + std::to_string(calls.size() % 3) +
+        ".example/repo-" + std::to_string(calls.size()) + ".git";
+    c.url = plainLiteral(c.record.url);
+    c.rev = literal();
+    c.sha256 = literal();
+    c.record.rev = c.rev.value;
+    c.record.sha256 = c.sha256.value;
+    c.record.newRev = differentValue(c.record.rev);
+    c.record.newSha256 = differentValue(c.record.sha256);
+
+    // Reserve the URL now, so that the next call gets a different one.
+    calls.push_back(c.record);
+    return c;
+}
+
+std::string Generator::newName(const char * prefix)
+{
+    return prefix + std::to_string(nameCount++);
+}
+
+// Writes a literal.  If newValue is not null, the expected output has
+// the literal for the new value instead.
+void Generator::emit(Writer & w, const Literal & l, const std::string * newValue)
+{
+    w.source += l.text;
+    w.expected += newValue ? encodeStringLiteral(*newValue) : l.text;
+}
+
+void Generator::beginAttr(Writer & w, const std::string & name)
+{
+    w.text(name);
+    space(w);
+    w.text("=");
+    space(w);
+}
+
+void Generator::endAttr(Writer & w)
+{
+    if (choose(2)) { space(w); }
+    w.text(";");
+    space(w);
+}
+
+void Generator::literalAttr(Writer & w, const std::string & name,
+    const Literal & l, const std::string * newValue)
+{
+    beginAttr(w, name);
+    emit(w, l, newValue);
+    endAttr(w);
+}
+
+void Generator::exprAttr(Writer & w, const std::string & name,
+    const std::string & expr)
+{
+    beginAttr(w, name);
+    w.text(expr);
+    endAttr(w);
+}
+
+void Generator::inherit(Writer & w, const std::string & from,
+    const std::vector<std::string> & names)
+{
+    w.text("inherit");
+    if (!from.empty())
+    {
+        space(w);
+        w.text("(" + from + ")");
+    }
+    for (const std::string & name : names)
+    {
+        space(w);
+        w.text(name);
+    }
+    endAttr(w);
+}
+
+// Passes variables to a function as attributes of the same name, with
+// inherit or with plain definitions.
+void Generator::passVariables(std::vector<Emitter> & args,
+    const std::vector<std::string> & names)
+{
+    if (choose(2))
+    {
+        args.push_back([=](Writer & w) { inherit(w, "", names); });
+        return;
+    }
+    for (const std::string & name : names)
+    {
+        args.push_back([=](Writer & w) { exprAttr(w, name, name); });
+    }
+}
+
+// Writes a call to fetchgit with the arguments in a random order.
+void Generator::fetchgit(Writer & w, std::vector<Emitter> args)
+{
+    if (choose(3) == 0)
+    {
+        args.push_back([&](Writer & w) { exprAttr(w, "fetchSubmodules", "true"); });
+    }
+    for (size_t i = args.size(); i > 1; i--)
+    {
+        std::swap(args[i - 1], args[choose(i)]);
+    }
+
+    w.text("fetchgit");
+    space(w);
+    w.text("{");
+    space(w);
+    for (Emitter & arg : args) { arg(w); }
+    w.text("}");
+}
+
+// Writes "let <bindings> in ", with the bindings in a random order.
+void Generator::letIn(Writer & w, std::vector<Emitter> bindings)
+{
+    for (size_t i = bindings.size(); i > 1; i--)
+    {
+        std::swap(bindings[i - 1], bindings[choose(i)]);
+    }
+    w.text("let");
+    space(w);
+    for (Emitter & binding : bindings) { binding(w); }
+    w.text("in");
+    space(w);
+}
+
+// pkg = fetchgit { url = "..."; rev = "..."; sha256 = "..."; };
+void Generator::directCall()
+{
+    Call c = newCall();
+    beginAttr(body, newName("pkg"));
+    fetchgit(body, {
+        [&](Writer & w) { literalAttr(w, "url", c.url, nullptr); },
+        [&](Writer & w) { literalAttr(w, "rev", c.rev, &c.record.newRev); },
+        [&](Writer & w) { literalAttr(w, "sha256", c.sha256, &c.record.newSha256); },
+    });
+    endAttr(body);
+}
+
+// pkg = let rev = "..."; sha256 = "..."; in fetchgit { inherit rev sha256; ... };
+void Generator::letBoundCall()
+{
+    Call c = newCall();
+    beginAttr(body, newName("pkg"));
+    letIn(body, {
+        [&](Writer & w) { literalAttr(w, "rev", c.rev, &c.record.newRev); },
+        [&](Writer & w) { literalAttr(w, "sha256", c.sha256, &c.record.newSha256); },
+    });
+    std::vector<Emitter> args {
+        [&](Writer & w) { literalAttr(w, "url", c.url, nullptr); },
+    };
+    passVariables(args, { "rev", "sha256" });
+    fetchgit(body, args);
+    endAttr(body);
+}
+
+// let revN = "..."; ... in { pkg = fetchgit { rev = revN; ... }; }
+void Generator::globalLetCall()
+{
+    Call c = newCall();
+    std::string rev = newName("rev"), hash = newName("hash");
+    literalAttr(bindings, rev, c.rev, &c.record.newRev);
+    literalAttr(bindings, hash, c.sha256, &c.record.newSha256);
+
+    beginAttr(body, newName("pkg"));
+    fetchgit(body, {
+        [&](Writer & w) { literalAttr(w, "url", c.url, nullptr); },
+        [&](Writer & w) { exprAttr(w, "rev", rev); },
+        [&](Writer & w) { exprAttr(w, "sha256", hash); },
+    });
+    endAttr(body);
+}
+
+// pkg = let v = { rev = "..."; ... }; in let inherit (v) rev sha256; in fetchgit { ... };
+void Generator::inheritFromCall()
+{
+    Call c = newCall();
+    beginAttr(body, newName("pkg"));
+    letIn(body, {
+        [&](Writer & w) {
+            beginAttr(w, "v");
+            w.text("{");
+            space(w);
+            literalAttr(w, "rev", c.rev, &c.record.newRev);
+            literalAttr(w, "sha256", c.sha256, &c.record.newSha256);
+            w.text("}");
+            endAttr(w);
+        },
+    });
+    letIn(body, {
+        [&](Writer & w) { inherit(w, "v", { "rev", "sha256" }); },
+    });
+    std::vector<Emitter> args {
+        [&](Writer & w) { literalAttr(w, "url", c.url, nullptr); },
+    };
+    passVariables(args, { "rev", "sha256" });
+    fetchgit(body, args);
+    endAttr(body);
+}
+
+// pkg = fetchgit ({ url = ...; rev = "old"; ... } // { rev = "..."; ... });
+void Generator::mergedCall()
+{
+    Call c = newCall();
+    Literal oldRev = literal(), oldHash = literal();
+    beginAttr(body, newName("pkg"));
+    body.text("fetchgit");
+    space(body);
+    body.text("({");
+    space(body);
+    literalAttr(body, "url", c.url, nullptr);
+    literalAttr(body, "rev", oldRev, nullptr);
+    literalAttr(body, "sha256", oldHash, nullptr);
+    body.text("}");
+    space(body);
+    body.text("//");
+    space(body);
+    body.text("{");
+    space(body);
+    literalAttr(body, "rev", c.rev, &c.record.newRev);
+    literalAttr(body, "sha256", c.sha256, &c.record.newSha256);
+    body.text("})");
+    endAttr(body);
+}
+
+// pkg = rec { rev = "..."; sha256 = "..."; src = fetchgit { inherit rev sha256; ... }; };
+void Generator::recCall()
+{
+    Call c = newCall();
+    beginAttr(body, newName("pkg"));
+    body.text("rec");
+    space(body);
+    body.text("{");
+    space(body);
+    literalAttr(body, "rev", c.rev, &c.record.newRev);
+    literalAttr(body, "sha256", c.sha256, &c.record.newSha256);
+    beginAttr(body, "src");
+    std::vector<Emitter> args {
+        [&](Writer & w) { literalAttr(w, "url", c.url, nullptr); },
+    };
+    passVariables(args, { "rev", "sha256" });
+    fetchgit(body, args);
+    endAttr(body);
+    body.text("}");
+    endAttr(body);
+}
+
+// let srcN = { rev = "..."; ... }; in { pkg = fetchgit { rev = srcN.rev; inherit (srcN) sha256; ... }; }
+void Generator::selectedCall()
+{
+    Call c = newCall();
+    std::string src = newName("src");
+    beginAttr(bindings, src);
+    bindings.text("{");
+    space(bindings);
+    literalAttr(bindings, "rev", c.rev, &c.record.newRev);
+    literalAttr(bindings, "sha256", c.sha256, &c.record.newSha256);
+    bindings.text("}");
+    endAttr(bindings);
+
+    beginAttr(body, newName("pkg"));
+    fetchgit(body, {
+        [&](Writer & w) { literalAttr(w, "url", c.url, nullptr); },
+        [&](Writer & w) { exprAttr(w, "rev", src + ".rev"); },
+        [&](Writer & w) { inherit(w, src, { "sha256" }); },
+    });
+    endAttr(body);
+}
+
+// Two calls that share a let-bound rev, and maybe the sha256 too.  If
+// they get different new values, neither can be rewritten.
+void Generator::sharedCalls()
+{
+    Call a = newCall();
+    Call b = newCall();
+    bool shareHash = choose(2);
+    b.rev = a.rev;
+    b.record.rev = a.record.rev;
+    if (shareHash)
+    {
+        b.sha256 = a.sha256;
+        b.record.sha256 = a.record.sha256;
+    }
+
+    bool rewritten = choose(3) != 0;
+    if (rewritten)
+    {
+        b.record.newRev = a.record.newRev;
+        if (shareHash) { b.record.newSha256 = a.record.newSha256; }
+    }
+    else
+    {
+        b.record.newRev = differentValue(a.record.newRev);
+    }
+    a.record.rewritten = b.record.rewritten = rewritten;
+    calls[calls.size() - 2] = a.record;
+    calls[calls.size() - 1] = b.record;
+
+    beginAttr(body, newName("pkg"));
+    letIn(body, {
+        [&](Writer & w) {
+            literalAttr(w, "rev", a.rev, rewritten ? &a.record.newRev : nullptr);
+        },
+        [&](Writer & w) {
+            literalAttr(w, "sha256", a.sha256, rewritten ? &a.record.newSha256 : nullptr);
+        },
+    });
+    body.text("{");
+    space(body);
+
+    beginAttr(body, "a");
+    std::vector<Emitter> args {
+        [&](Writer & w) { literalAttr(w, "url", a.url, nullptr); },
+    };
+    passVariables(args, { "rev", "sha256" });
+    fetchgit(body, args);
+    endAttr(body);
+
+    beginAttr(body, "b");
+    args = {
+        [&](Writer & w) { literalAttr(w, "url", b.url, nullptr); },
+        [&](Writer & w) { inherit(w, "", { "rev" }); },
+    };
+    if (shareHash)
+    {
+        args.push_back([&](Writer & w) { inherit(w, "", { "sha256" }); });
+    }
+    else
+    {
+        args.push_back([&](Writer & w) {
+            literalAttr(w, "sha256", b.sha256, rewritten ? &b.record.newSha256 : nullptr);
+        });
+    }
+    fetchgit(body, args);
+    endAttr(body);
+
+    body.text("}");
+    endAttr(body);
+}
+
+// A let-bound rev or sha256 that is also used outside the call, so
+// rewriting it would change something else too.  The scanner still finds
+// the call, so that it can be verified.
+void Generator::usedElsewhereCall()
+{
+    Call c = newCall();
+    c.record.rewritable = false;
+    calls.back() = c.record;
+
+    beginAttr(body, newName("pkg"));
+    letIn(body, {
+        [&](Writer & w) { literalAttr(w, "rev", c.rev, nullptr); },
+        [&](Writer & w) { literalAttr(w, "sha256", c.sha256, nullptr); },
+    });
+    body.text("{");
+    space(body);
+    switch (choose(3))
+    {
+    case 0: exprAttr(body, "name", "\"foo-${rev}\""); break;
+    case 1: exprAttr(body, "version", "rev"); break;
+    default: exprAttr(body, "passthru", "{ inherit sha256; }"); break;
+    }
+    beginAttr(body, "src");
+    std::vector<Emitter> args {
+        [&](Writer & w) { literalAttr(w, "url", c.url, nullptr); },
+    };
+    passVariables(args, { "rev", "sha256" });
+    fetchgit(body, args);
+    endAttr(body);
+    body.text("}");
+    endAttr(body);
+}
+
+// pkg = fetchgit { rev = ("..."); ... };  The parser drops the
+// parentheses, so the scanner finds the call, but the literal is not
+// where the rewriter looks for it, so the call is not rewritten.
+void Generator::parenthesizedCall()
+{
+    Call c = newCall();
+    c.record.rewritable = false;
+    calls.back() = c.record;
+
+    unsigned int inParentheses = choose(3);
+    auto attr = [&](Writer & w, const char * name, const Literal & l, bool parenthesized)
+    {
+        if (!parenthesized) { return literalAttr(w, name, l, nullptr); }
+        beginAttr(w, name);
+        w.text("(");
+        if (choose(2)) { space(w); }
+        emit(w, l, nullptr);
+        w.text(")");
+        endAttr(w);
+    };
+
+    beginAttr(body, newName("pkg"));
+    fetchgit(body, {
+        [&](Writer & w) { literalAttr(w, "url", c.url, nullptr); },
+        [&](Writer & w) { attr(w, "rev", c.rev, inParentheses != 1); },
+        [&](Writer & w) { attr(w, "sha256", c.sha256, inParentheses != 0); },
+    });
+    endAttr(body);
+}
+
+// pkg = { rev ? "..." }: fetchgit { inherit rev; ... };
+void Generator::functionArgumentCall()
+{
+    Call c = newCall();
+    c.record.found = false;
+    calls.back() = c.record;
+
+    beginAttr(body, newName("pkg"));
+    body.text("{");
+    space(body);
+    body.text("rev");
+    space(body);
+    body.text("?");
+    space(body);
+    emit(body, c.rev, nullptr);
+    space(body);
+    body.text("}:");
+    space(body);
+    fetchgit(body, {
+        [&](Writer & w) { literalAttr(w, "url", c.url, nullptr); },
+        [&](Writer & w) { inherit(w, "", { "rev" }); },
+        [&](Writer & w) { literalAttr(w, "sha256", c.sha256, nullptr); },
+    });
+    endAttr(body);
+}
+
+// pkg = (x: fetchgit { ... }) null;  A function with a single argument
+// has no formals, and the call inside it is found like any other.
+void Generator::plainFunctionCall()
+{
+    Call c = newCall();
+    beginAttr(body, newName("pkg"));
+    body.text("(");
+    if (choose(2)) { space(body); }
+    body.text("x:");
+    space(body);
+    fetchgit(body, {
+        [&](Writer & w) { literalAttr(w, "url", c.url, nullptr); },
+        [&](Writer & w) { literalAttr(w, "rev", c.rev, &c.record.newRev); },
+        [&](Writer & w) { literalAttr(w, "sha256", c.sha256, &c.record.newSha256); },
+    });
+    if (choose(2)) { space(body); }
+    body.text(")");
+    space(body);
+    body.text("null");
+    endAttr(body);
+}
+
+// pkg = fetchurl { url = "..."; sha256 = "..."; };
+void Generator::fetchurlCall()
+{
+    Call c = newCall();
+    c.record.found = false;
+    calls.back() = c.record;
+
+    beginAttr(body, newName("pkg"));
+    body.text("fetchurl");
+    space(body);
+    body.text("{");
+    space(body);
+    literalAttr(body, "url", c.url, nullptr);
+    literalAttr(body, "sha256", c.sha256, nullptr);
+    body.text("}");
+    endAttr(body);
+}
+
+GeneratedNix Generator::generate(unsigned int maxCalls)
+{
+    unsigned int count = choose(maxCalls + 1);
+    while (calls.size() < count)
+    {
+        switch (choose(13))
+        {
+        case 0: directCall(); break;
+        case 1: letBoundCall(); break;
+        case 2: globalLetCall(); break;
+        case 3: inheritFromCall(); break;
+        case 4: mergedCall(); break;
+        case 5: recCall(); break;
+        case 6: selectedCall(); break;
+        case 7: sharedCalls(); break;
+        case 8: usedElsewhereCall(); break;
+        case 9: functionArgumentCall(); break;
+        case 10: parenthesizedCall(); break;
+        case 11: plainFunctionCall(); break;
+        default: fetchurlCall(); break;
+        }
+    }
+
+    // nix checks at parse time that every variable is bound.
+    Writer file;
+    file.text(choose(2) ? "{ fetchgit, fetchurl }:" : "{ fetchurl, fetchgit, ... }:");
+    space(file);
+    file.text("let");
+    space(file);
+    file.append(bindings);
+    file.text("in");
+    space(file);
+    file.text("{");
+    space(file);
+    file.append(body);
+    file.text("}\n");
+
+    GeneratedNix result;
+    result.source = file.source;
+    result.expected = file.expected;
+    result.calls = calls;
+    return result;
+}
+
+GeneratedNix generateFetchGitNix(const ChoiceFunction & choose, unsigned int maxCalls)
+{
+    return Generator(choose).generate(maxCalls);
+}
+
+static std::string hexValue(const ChoiceFunction & choose, size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string value;
+    for (size_t i = 0; i < length; i++) { value += digits[choose(16)]; }
+    return value;
+}
+
+GeneratedNix generatePackageSetNix(const ChoiceFunction & choose,
+    unsigned int packageCount)
+{
+    GeneratedNix result;
+    Writer sources, packages;
+    for (unsigned int i = 0; i < packageCount; i++)
+    {
+        GeneratedCall call;
+        std::string name = "p" + std::to_string(i);
+        call.url = "https://host" + std::to_string(i % 7) + ".example/" + name + ".git";
+        call.rev = hexValue(choose, 40);
+        call.sha256 = hexValue(choose, 52);
+        call.newRev = hexValue(choose, 40);
+        call.newSha256 = hexValue(choose, 52);
+        if (call.newRev == call.rev) { call.newRev += "0"; }
+        if (call.newSha256 == call.sha256) { call.newSha256 += "0"; }
+        result.calls.push_back(call);
+
+        sources.text("    " + name + " = {\n      url = \"" + call.url + "\";\n");
+        sources.text("      rev = ");
+        sources.source += "\"" + call.rev + "\"";
+        sources.expected += encodeStringLiteral(call.newRev);
+        sources.text(";\n      sha256 = ");
+        sources.source += "\"" + call.sha256 + "\"";
+        sources.expected += encodeStringLiteral(call.newSha256);
+        sources.text(";\n    };\n");
+
+        std::string source = "sources." + name;
+        packages.text("  " + name + " = fetchgit {\n"
+            "    inherit (" + source + ") url;\n"
+            "    rev = " + source + ".rev;\n"
+            "    sha256 = " + source + ".sha256;\n"
+            "  };\n");
+    }
+
+    Writer file;
+    file.text("{ fetchgit }:\nlet\n  sources = {\n");
+    file.append(sources);
+    file.text("  };\nin\n{\n");
+    file.append(packages);
+    file.text("}\n");
+    result.source = file.source;
+    result.expected = file.expected;
+    return result;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/** Picks a number from 0 to n - 1.  All the choices the generator makes
+ * go through this, so a test can drive it from a seeded random number
+ * generator and a fuzzer can drive it from its input bytes. */
+typedef std::function<unsigned int(unsigned int n)> ChoiceFunction;
+
+/** A call to fetchgit in generated source, with the values the test
+ * should plan for it.  Each call has its own URL.  found tells whether
+ * the scanner should find the call at all, rewritable whether the
+ * scanner should find that its literals can be rewritten, and rewritten
+ * whether its literals should change once the new values are planned; a
+ * rewritable call that is not rewritten shares a literal with a call
+ * that gets a different value. */
+struct GeneratedCall
+{
+    std::string url;
+    std::string rev, sha256;
+    std::string newRev, newSha256;
+    bool found = true;
+    bool rewritable = true;
+    bool rewritten = true;
+};
+
+/** Generated .nix source, along with the source as it should be after
+ * the planned values have been written, with each rewritten literal
+ * spelled the way encodeStringLiteral spells it. */
+struct GeneratedNix
+{
+    std::string source;
+    std::string expected;
+    std::vector<GeneratedCall> calls;
+};
+
+/** Generates a file with up to maxCalls calls to fetchgit in the ways
+ * that the scanner has to handle: literal arguments, let bindings,
+ * inherit, inherit from a set, // merges, rec sets, selections,
+ * literals shared between calls, and calls inside functions like
+ * "x: body" that have no formals.  The literals are "double-quoted" with
+ * escapes, ''indented'' over several lines, or built from antiquoted
+ * pieces.  There are also calls that the scanner must leave alone,
+ * because an argument is a function argument, calls that it must find
+ * but not rewrite, because a literal is in parentheses or is also used
+ * outside the call, and calls to fetchurl.  Comments and line breaks go
+ * between the tokens. */
+GeneratedNix generateFetchGitNix(const ChoiceFunction & choose, unsigned int maxCalls);
+
+/** Generates a large package set in the style of nixpkgs sources files:
+ * one set of revisions and hashes that packageCount calls to fetchgit
+ * select from.  Every call is rewritten.  This is for measuring how the
+ * scanner scales. */
+GeneratedNix generatePackageSetNix(const ChoiceFunction & choose,
+    unsigned int packageCount);
@@ -0,0 +1,180 @@
+#include "rewrite-check.hh"
+#include "trace.hh"
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <stdexcept>
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Makes up a value for the literal defined at the given position.  The
+// value only depends on the seed and the position, so call sites that
+// share one literal get the same value.
+static std::string randomValue(unsigned int seed, uint32_t line, uint32_t column)
+{
+    static const char * const pieces[] = {
+        "0", "7", "a", "f", "z", "\"", "\\", "$", "${", "$$", "}", "''",
+        "\n", "\r", "\t", " ", "#", "/*", "\xc3\xa9",
+    };
+    const size_t pieceCount = sizeof(pieces) / sizeof(pieces[0]);
+
+    std::seed_seq seq { seed, line, column };
+    std::mt19937 rng(seq);
+    std::string value;
+    size_t length = rng() % 48;
+    for (size_t i = 0; i < length; i++)
+    {
+        value += pieces[rng() % pieceCount];
+    }
+    return value;
+}
+
+// Finds the line of the first byte where two strings differ.
+static size_t firstDifferentLine(const std::string & a, const std::string & b)
+{
+    size_t line = 1;
+    for (size_t i = 0; i < a.size() && i < b.size() && a[i] == b[i]; i++)
+    {
+        if (a[i] == '\n') { line++; }
+    }
+    return line;
+}
+
+namespace
+{
+    // A literal that the check rewrites: its new value and the literal
+    // that spells it out, and the index of its replacement.
+    struct NewLiteral
+    {
+        std::string value;
+        std::string literal;
+        size_t index;
+    };
+}
+
+RewriteCheckResult checkRewriting(nix::EvalState & state,
+    const std::string & contents, const std::string & basePath,
+    unsigned int seed)
+{
+    TraceScope trace("checkRewriting");
+    RewriteCheckResult result;
+    result.bytes = contents.size();
+    StringPool pool;
+
+    Clock::time_point start = Clock::now();
+    std::vector<FetchGitApp> apps = scanFetchGitString(state, contents, basePath, pool);
+    result.scanSeconds = secondsSince(start);
+    result.callSites = apps.size();
+
+    // Plan a new value for every rev and sha256 literal.  The map does not
+    // move its elements, so the replacements can point into it.
+    std::map<std::pair<uint32_t, uint32_t>, NewLiteral> newLiterals;
+    std::vector<StringReplacement> replacements;
+    auto plan = [&](uint32_t line, uint32_t column, StringPool::Id oldId)
+    {
+        auto key = std::make_pair(line, column);
+        if (newLiterals.count(key)) { return; }
+        NewLiteral & nl = newLiterals[key];
+        nl.value = randomValue(seed, line, column);
+        nl.literal = encodeStringLiteral(nl.value);
+        nl.index = replacements.size();
+
+        StringReplacement sr;
+        sr.line = line;
+        sr.column = column;
+        sr.oldValue = pool.get(oldId).inner();
+        sr.newString = StringRef(nl.literal.data(), nl.literal.size());
+        replacements.push_back(sr);
+    };
+    for (const FetchGitApp & fga : apps)
+    {
+        if (!fga.canRewrite()) { continue; }
+        plan(fga.revLine, fga.revColumn, fga.rev);
+        plan(fga.hashLine, fga.hashColumn, fga.hash);
+    }
+    result.replacements = replacements.size();
+
+    start = Clock::now();
+    std::string rewritten = applyReplacements(contents, replacements);
+    result.rewriteSeconds = secondsSince(start);
+
+    // Parse the result and check that each call has the new values.  The
+    // structure of the file is unchanged, so the calls are found in the
+    // same order.
+    std::vector<FetchGitApp> reparsed = scanFetchGitString(state, rewritten,
+        basePath, pool);
+    if (reparsed.size() != apps.size())
+    {
+        throw std::runtime_error("Rewriting changed the number of calls to fetchgit "
+            "from " + std::to_string(apps.size()) + " to " +
+            std::to_string(reparsed.size()) + ".");
+    }
+
+    // Plan the replacements that put back the original text of each
+    // literal, at the positions found in the rewritten file.
+    std::vector<LiteralRange> originals = findReplacementLiterals(contents,
+        replacements);
+    std::vector<StringReplacement> restorations;
+    auto check = [&](uint32_t line, uint32_t column, StringPool::Id oldId,
+        StringPool::Id newId, uint32_t newLine, uint32_t newColumn, const char * name)
+    {
+        StringRef value = pool.get(newId).inner();
+        auto it = newLiterals.find(std::make_pair(line, column));
+        if (it == newLiterals.end())
+        {
+            // A literal that cannot be rewritten must be left alone.
+            if (value != pool.get(oldId).inner())
+            {
+                throw std::runtime_error(std::string("The ") + name + " defined on line " +
+                    std::to_string(line) + " changed, but it was not rewritten.");
+            }
+            return;
+        }
+
+        const NewLiteral & nl = it->second;
+        if (value != StringRef(nl.value.data(), nl.value.size()))
+        {
+            throw std::runtime_error(std::string("The ") + name + " defined on line " +
+                std::to_string(line) + " has the wrong value after rewriting.");
+        }
+
+        const LiteralRange & original = originals[nl.index];
+        StringReplacement sr;
+        sr.line = newLine;
+        sr.column = newColumn;
+        sr.oldValue = value;
+        sr.newString = StringRef(contents.data() + original.begin,
+            original.end - original.begin);
+        restorations.push_back(sr);
+    };
+    for (size_t i = 0; i < apps.size(); i++)
+    {
+        const FetchGitApp & before = apps[i];
+        const FetchGitApp & after = reparsed[i];
+        if (after.url != before.url)
+        {
+            throw std::runtime_error("The call to fetchgit for " +
+                pool.get(before.url).str() + " has a different url after rewriting.");
+        }
+        check(before.revLine, before.revColumn, before.rev, after.rev,
+            after.revLine, after.revColumn, "rev");
+        check(before.hashLine, before.hashColumn, before.hash, after.hash,
+            after.hashLine, after.hashColumn, "sha256");
+    }
+
+    std::string restored = applyReplacements(rewritten, restorations);
+    if (restored != contents)
+    {
+        throw std::runtime_error("Rewriting the literals back did not restore the "
+            "original file; the first difference is on line " +
+            std::to_string(firstDifferentLine(restored, contents)) + ".");
+    }
+
+    return result;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "fetchgit-updater.hh"
+
+/** What checkRewriting did, and how fast it went. */
+struct RewriteCheckResult
+{
+    size_t callSites = 0;
+    size_t replacements = 0;
+    size_t bytes = 0;
+    double scanSeconds = 0;
+    double rewriteSeconds = 0;
+};
+
+/** Checks that the scanner and applyReplacements work on a .nix file,
+ * without fetching anything or touching the file.  Every rev and sha256
+ * literal of the calls that can be rewritten is rewritten to a
+ * pseudo-random value made from the seed, which includes quotes,
+ * backslashes, dollar signs and control characters.  The result is
+ * parsed again and must have the same calls to fetchgit with the new
+ * values, and the other literals unchanged.  Then the new literals are
+ * rewritten back to their original text at the positions found by the
+ * second parse, which must give back the original contents byte for
+ * byte, so nothing outside the targeted literals can have changed.
+ * Throws an exception describing the first difference found. */
+RewriteCheckResult checkRewriting(nix::EvalState & state,
+    const std::string & contents, const std::string & basePath,
+    unsigned int seed);
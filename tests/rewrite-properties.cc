@@ -0,0 +1,99 @@
+#include "rewrite-properties.hh"
+#include "rewrite-check.hh"
+
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+static void fail(const std::string & what)
+{
+    throw std::runtime_error(what);
+}
+
+static std::string printExpr(nix::EvalState & state, const std::string & source)
+{
+    std::ostringstream stream;
+    stream << *state.parseExprFromString(source, "/");
+    return stream.str();
+}
+
+static bool refEquals(StringRef ref, const std::string & value)
+{
+    return ref == StringRef(value.data(), value.size());
+}
+
+void checkGeneratedNix(nix::EvalState & state, const GeneratedNix & generated,
+    unsigned int seed)
+{
+    std::map<std::string, const GeneratedCall *> expectedCalls;
+    size_t expectedDropped = 0;
+    for (const GeneratedCall & call : generated.calls)
+    {
+        if (!call.found) { continue; }
+        expectedCalls[call.url] = &call;
+        if (call.rewritable && !call.rewritten) { expectedDropped++; }
+    }
+
+    StringPool pool;
+    std::vector<FetchGitApp> apps = scanFetchGitString(state, generated.source,
+        "/", pool);
+    if (apps.size() != expectedCalls.size())
+    {
+        fail("Found " + std::to_string(apps.size()) + " calls to fetchgit " +
+            "instead of " + std::to_string(expectedCalls.size()) + ".");
+    }
+
+    // Plan the new values.  They can be anything, so they are written
+    // with encodeStringLiteral.
+    std::map<std::string, const GeneratedCall *> seen;
+    for (FetchGitApp & fga : apps)
+    {
+        std::string url = pool.get(fga.url).str();
+        auto it = expectedCalls.find(url);
+        if (it == expectedCalls.end()) { fail("Found an unexpected call for " + url + "."); }
+        if (seen.count(url)) { fail("Found the call for " + url + " twice."); }
+        const GeneratedCall & call = *it->second;
+        seen[url] = &call;
+
+        if (!refEquals(pool.get(fga.rev).inner(), call.rev))
+        {
+            fail("The call for " + url + " has the wrong rev.");
+        }
+        if (!refEquals(pool.get(fga.hash).inner(), call.sha256))
+        {
+            fail("The call for " + url + " has the wrong sha256.");
+        }
+        if (fga.canRewrite() != call.rewritable)
+        {
+            fail("The call for " + url + (call.rewritable ? " cannot" : " can") +
+                " be rewritten.");
+        }
+        fga.newRev = pool.intern(encodeStringLiteral(call.newRev));
+        fga.newHash = pool.intern(encodeStringLiteral(call.newSha256));
+    }
+
+    size_t dropped = dropConflictingUpdates(apps, pool);
+    if (dropped != expectedDropped)
+    {
+        fail("Dropped " + std::to_string(dropped) + " conflicting updates " +
+            "instead of " + std::to_string(expectedDropped) + ".");
+    }
+
+    std::vector<StringReplacement> replacements;
+    for (const FetchGitApp & fga : apps)
+    {
+        addStringReplacements(fga, pool, replacements);
+    }
+    std::string rewritten = applyReplacements(generated.source, replacements);
+
+    if (printExpr(state, rewritten) != printExpr(state, generated.expected))
+    {
+        fail("The rewritten source does not parse to the expected expression.");
+    }
+    if (rewritten != generated.expected)
+    {
+        fail("The rewritten source is not spelled as expected.");
+    }
+
+    checkRewriting(state, generated.source, "/", seed);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "nix-generator.hh"
+
+#include <eval.hh>
+
+/** Checks the scanner and the rewriting path against generated source.
+ * The calls found must be exactly the ones the generator says should be
+ * found, with the right values, and the right ones must be rewritable.  After planning the new values and
+ * dropping conflicting updates, applyReplacements must give source that
+ * parses to the same expression as the expected source, and that is
+ * byte for byte the expected source.  Finally checkRewriting, with the
+ * given seed, must be able to rewrite every literal and back.  Throws an
+ * exception describing the first property that does not hold. */
+void checkGeneratedNix(nix::EvalState & state, const GeneratedNix & generated,
+    unsigned int seed);
@@ -0,0 +1,149 @@
+// Checks the scanner and the rewriting path on generated .nix files, and
+// checks that they are fast enough and scale linearly.
+
+#include "rewrite-properties.hh"
+#include "rewrite-check.hh"
+
+#include <shared.hh>
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+
+// How many generated files to check, and the most calls in each.
+static const unsigned int propertySeeds = 2000;
+static const unsigned int maxCallsPerFile = 12;
+
+// The slowest acceptable speeds, in megabytes of source per second, for
+// scanning a large package set (parsing included) and for rewriting every
+// rev and sha256 in it.  These are well below what the code does on a
+// laptop, so that they only fail when something gets a lot slower.
+static const double minScanMegabytesPerSecond = 2;
+static const double minRewriteMegabytesPerSecond = 10;
+
+// Scanning a package set four times as large may take at most this many
+// times as long.  Linear scaling gives 4; quadratic gives 16.
+static const unsigned int scalePackages = 1000;
+static const double maxScaleFactor = 8;
+
+static int failures = 0;
+
+static ChoiceFunction seededChoices(std::mt19937 & rng)
+{
+    return [&](unsigned int n) -> unsigned int {
+        return n <= 1 ? 0 : rng() % n;
+    };
+}
+
+static void checkProperties(nix::EvalState & state)
+{
+    for (unsigned int seed = 1; seed <= propertySeeds; seed++)
+    {
+        std::mt19937 rng(seed);
+        GeneratedNix generated = generateFetchGitNix(seededChoices(rng), maxCallsPerFile);
+        try
+        {
+            checkGeneratedNix(state, generated, seed);
+        }
+        catch (const std::exception & e)
+        {
+            std::cerr << "seed " << seed << ": " << e.what() << std::endl;
+            if (failures++ == 0)
+            {
+                std::cerr << "--- source:" << std::endl << generated.source
+                          << "--- expected:" << std::endl << generated.expected
+                          << "---" << std::endl;
+            }
+        }
+    }
+}
+
+// Times scanning and rewriting a generated package set, taking the best
+// of a few runs to keep noise down.
+static void timePackageSet(nix::EvalState & state, unsigned int packageCount,
+    double & scanSeconds, double & rewriteSeconds, size_t & bytes)
+{
+    std::mt19937 rng(packageCount);
+    GeneratedNix generated = generatePackageSetNix(seededChoices(rng), packageCount);
+    bytes = generated.source.size();
+
+    scanSeconds = rewriteSeconds = 1e9;
+    for (int run = 0; run < 3; run++)
+    {
+        RewriteCheckResult result = checkRewriting(state, generated.source, "/", run);
+        if (result.callSites != packageCount)
+        {
+            std::cerr << "Found " << result.callSites << " calls in a package set of "
+                      << packageCount << "." << std::endl;
+            failures++;
+        }
+        scanSeconds = std::min(scanSeconds, result.scanSeconds);
+        rewriteSeconds = std::min(rewriteSeconds, result.rewriteSeconds);
+    }
+}
+
+static void checkSpeed(nix::EvalState & state)
+{
+    double smallScan, smallRewrite, largeScan, largeRewrite;
+    size_t smallBytes, largeBytes;
+    timePackageSet(state, scalePackages, smallScan, smallRewrite, smallBytes);
+    timePackageSet(state, scalePackages * 4, largeScan, largeRewrite, largeBytes);
+
+    double scanSpeed = largeBytes / 1e6 / largeScan;
+    double rewriteSpeed = largeBytes / 1e6 / largeRewrite;
+    std::cout << "Scanning: " << scanSpeed << " MB/s, rewriting: "
+              << rewriteSpeed << " MB/s, " << largeBytes << " bytes" << std::endl;
+    if (scanSpeed < minScanMegabytesPerSecond)
+    {
+        std::cerr << "Scanning is slower than " << minScanMegabytesPerSecond
+                  << " MB/s." << std::endl;
+        failures++;
+    }
+    if (rewriteSpeed < minRewriteMegabytesPerSecond)
+    {
+        std::cerr << "Rewriting is slower than " << minRewriteMegabytesPerSecond
+                  << " MB/s." << std::endl;
+        failures++;
+    }
+
+    double scanFactor = largeScan / smallScan;
+    double rewriteFactor = largeRewrite / smallRewrite;
+    std::cout << "Four times the packages: scanning took " << scanFactor
+              << " times as long, rewriting " << rewriteFactor << " times." << std::endl;
+    if (scanFactor > maxScaleFactor || rewriteFactor > maxScaleFactor)
+    {
+        std::cerr << "Scanning or rewriting does not scale linearly." << std::endl;
+        failures++;
+    }
+}
+
+int main()
+{
+    nix::initNix();
+    nix::initGC();
+
+    // The generator makes call sites that the scanner skips with a
+    // warning on purpose.
+    nix::verbosity = nix::lvlError;
+
+    try
+    {
+        nix::Strings searchPath;
+        nix::EvalState state(searchPath);
+        checkProperties(state);
+        checkSpeed(state);
+    }
+    catch (const std::exception & e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    if (failures)
+    {
+        std::cerr << failures << " checks failed." << std::endl;
+        return 1;
+    }
+    std::cout << "rewrite-test: all checks passed." << std::endl;
+    return 0;
+}
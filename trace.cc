@@ -0,0 +1,132 @@
+#include "trace.hh"
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <system_error>
+#include <vector>
+
+bool traceEnabled = false;
+std::atomic<uint64_t> traceCounters[counterCount];
+
+static const char * counterNames[counterCount] = {
+    "nodesVisited",
+    "dynamicCasts",
+    "bytesRead",
+    "bytesWritten",
+    "subprocesses",
+    "subprocessMicroseconds",
+};
+
+namespace
+{
+    struct TraceSpan
+    {
+        const char * name;
+        std::string detail;
+        uint64_t start;
+        uint64_t duration;
+        unsigned int thread;
+    };
+}
+
+static std::chrono::steady_clock::time_point traceStartTime;
+static std::mutex traceSpansMutex;
+static std::vector<TraceSpan> traceSpans;
+static std::atomic<unsigned int> traceThreadCount(0);
+
+void setTraceEnabled(bool enabled)
+{
+    traceStartTime = std::chrono::steady_clock::now();
+    for (auto & counter : traceCounters) { counter = 0; }
+    traceEnabled = enabled;
+}
+
+uint64_t traceNow()
+{
+    auto elapsed = std::chrono::steady_clock::now() - traceStartTime;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+// Returns a small number identifying the current thread in the trace.
+static unsigned int traceThreadId()
+{
+    thread_local unsigned int id = traceThreadCount++;
+    return id;
+}
+
+void traceRecordSpan(const char * name, const std::string & detail,
+    uint64_t start, uint64_t duration)
+{
+    TraceSpan span { name, detail, start, duration, traceThreadId() };
+    std::lock_guard<std::mutex> lock(traceSpansMutex);
+    traceSpans.push_back(span);
+}
+
+static void writeJsonString(std::ostream & stream, const std::string & str)
+{
+    static const char * hex = "0123456789abcdef";
+    stream << '"';
+    for (unsigned char c : str)
+    {
+        if (c == '"' || c == '\\') { stream << '\\' << c; }
+        else if (c < 0x20) { stream << "\\u00" << hex[c >> 4] << hex[c & 0xF]; }
+        else { stream << c; }
+    }
+    stream << '"';
+}
+
+void writeTrace(const std::string & path)
+{
+    std::ofstream stream(path);
+    if (stream.fail())
+    {
+        int ev = errno;
+        std::string what = std::string("Failed to open file for writing: ") + path;
+        throw std::system_error(ev, std::system_category(), what);
+    }
+
+    std::lock_guard<std::mutex> lock(traceSpansMutex);
+
+    stream << "{\"traceEvents\":[\n";
+    for (const TraceSpan & span : traceSpans)
+    {
+        stream << "{\"name\":";
+        writeJsonString(stream, span.name);
+        stream << ",\"cat\":\"nix-update-git\",\"ph\":\"X\",\"pid\":1"
+               << ",\"tid\":" << span.thread
+               << ",\"ts\":" << span.start
+               << ",\"dur\":" << span.duration;
+        if (!span.detail.empty())
+        {
+            stream << ",\"args\":{\"detail\":";
+            writeJsonString(stream, span.detail);
+            stream << "}";
+        }
+        stream << "},\n";
+    }
+
+    // Report the final value of each counter at the end of the run.
+    stream << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":0"
+           << ",\"ts\":" << traceNow() << ",\"args\":{";
+    for (int i = 0; i < counterCount; i++)
+    {
+        if (i != 0) { stream << ","; }
+        stream << "\"" << counterNames[i] << "\":" << traceCounters[i];
+    }
+    stream << "}}\n]}\n";
+
+    if (stream.fail())
+    {
+        throw std::runtime_error("Failed to write trace file.");
+    }
+}
+
+void printTraceCounters(std::ostream & stream)
+{
+    for (int i = 0; i < counterCount; i++)
+    {
+        stream << "  " << counterNames[i] << ": " << traceCounters[i] << std::endl;
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+// Lightweight instrumentation of the hot paths.  Tracing is switched on
+// at run time with setTraceEnabled; while it is off, each counter and
+// scope costs a single predictable branch.  Defining NIX_UPDATE_NO_TRACE
+// removes the instrumentation entirely.
+
+#include <atomic>
+#include <iosfwd>
+#include <cstdint>
+#include <string>
+
+enum TraceCounter
+{
+    counterNodesVisited,
+    counterDynamicCasts,
+    counterBytesRead,
+    counterBytesWritten,
+    counterSubprocesses,
+    counterSubprocessMicroseconds,
+    counterCount
+};
+
+extern bool traceEnabled;
+extern std::atomic<uint64_t> traceCounters[counterCount];
+
+/** Turns tracing on or off.  This must be called before any other
+ * threads are started. */
+void setTraceEnabled(bool enabled);
+
+/** Returns the number of microseconds since tracing was enabled. */
+uint64_t traceNow();
+
+/** Records a completed span of work on the current thread. */
+void traceRecordSpan(const char * name, const std::string & detail,
+    uint64_t start, uint64_t duration);
+
+inline void traceCount(TraceCounter counter, uint64_t amount = 1)
+{
+#ifndef NIX_UPDATE_NO_TRACE
+    if (traceEnabled)
+    {
+        traceCounters[counter].fetch_add(amount, std::memory_order_relaxed);
+    }
+#endif
+}
+
+/** Records the time from construction to destruction as a span.  If a
+ * counter is given, the duration in microseconds is added to it. */
+class TraceScope
+{
+#ifndef NIX_UPDATE_NO_TRACE
+    const char * name;
+    std::string detail;
+    TraceCounter durationCounter;
+    uint64_t start;
+    bool active;
+#endif
+
+public:
+    TraceScope(const char * name, TraceCounter durationCounter = counterCount)
+    {
+#ifndef NIX_UPDATE_NO_TRACE
+        active = traceEnabled;
+        if (!active) { return; }
+        this->name = name;
+        this->durationCounter = durationCounter;
+        start = traceNow();
+#endif
+    }
+
+    TraceScope(const char * name, const std::string & detail,
+        TraceCounter durationCounter = counterCount)
+        : TraceScope(name, durationCounter)
+    {
+#ifndef NIX_UPDATE_NO_TRACE
+        if (active) { this->detail = detail; }
+#endif
+    }
+
+    ~TraceScope()
+    {
+#ifndef NIX_UPDATE_NO_TRACE
+        if (!active) { return; }
+        uint64_t duration = traceNow() - start;
+        if (durationCounter != counterCount)
+        {
+            traceCount(durationCounter, duration);
+        }
+        traceRecordSpan(name, detail, start, duration);
+#endif
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope & operator = (const TraceScope &) = delete;
+};
+
+/** Writes the recorded spans and the final counter values to a file in
+ * the Chrome trace-event JSON format. */
+void writeTrace(const std::string & path);
+
+/** Prints the counter values in a human-readable form. */
+void printTraceCounters(std::ostream & stream);